@@ -17,4 +17,6 @@ inline void delay_us(u32 us) {
 
 inline u32 millis() { return HAL_GetTick(); }
 
+inline u32 cycle_count() { return DWT->CYCCNT; }
+
 }  // namespace jstm
@@ -13,13 +13,22 @@ void CAN2_RX1_IRQHandler() { HAL_CAN_IRQHandler(g_rtcan->can_handle()); }
 void CAN2_SCE_IRQHandler() { HAL_CAN_IRQHandler(g_rtcan->can_handle()); }
 
 void HAL_CAN_TxMailbox0CompleteCallback(CAN_HandleTypeDef*) {
-  if (g_rtcan) g_rtcan->handle_tx_complete_isr();
+  if (g_rtcan) g_rtcan->handle_tx_complete_isr(0);
 }
 void HAL_CAN_TxMailbox1CompleteCallback(CAN_HandleTypeDef*) {
-  if (g_rtcan) g_rtcan->handle_tx_complete_isr();
+  if (g_rtcan) g_rtcan->handle_tx_complete_isr(1);
 }
 void HAL_CAN_TxMailbox2CompleteCallback(CAN_HandleTypeDef*) {
-  if (g_rtcan) g_rtcan->handle_tx_complete_isr();
+  if (g_rtcan) g_rtcan->handle_tx_complete_isr(2);
+}
+void HAL_CAN_TxMailbox0AbortCallback(CAN_HandleTypeDef*) {
+  if (g_rtcan) g_rtcan->handle_tx_abort_isr(0);
+}
+void HAL_CAN_TxMailbox1AbortCallback(CAN_HandleTypeDef*) {
+  if (g_rtcan) g_rtcan->handle_tx_abort_isr(1);
+}
+void HAL_CAN_TxMailbox2AbortCallback(CAN_HandleTypeDef*) {
+  if (g_rtcan) g_rtcan->handle_tx_abort_isr(2);
 }
 void HAL_CAN_RxFifo0MsgPendingCallback(CAN_HandleTypeDef*) {
   if (g_rtcan) g_rtcan->handle_rx_isr(CAN_RX_FIFO0);
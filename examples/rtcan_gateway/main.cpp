@@ -0,0 +1,129 @@
+#include <jstm/hal/gpio.hpp>
+#include <jstm/hal/hal.hpp>
+#include <jstm/log.hpp>
+#include <jstm/rtcan/hal_callbacks.hpp>
+#include <jstm/rtcan/rtcan.hpp>
+#include <jstm/rtos/rtos.hpp>
+
+using namespace jstm;
+
+// can1 producer ids 0x100..0x10f, forwarded to can2 as 0x500..0x50e with
+// 0x10f dropped. can2 producer ids 0x200..0x20f, forwarded to can1 as-is.
+static constexpr u32 A_BASE = 0x100;
+static constexpr u32 A_REMAP = 0x500;
+static constexpr u32 A_DROPPED = 0x10F;
+static constexpr u32 B_BASE = 0x200;
+static constexpr u16 IDS = 16;
+
+static rtcan::service* g_a = nullptr;
+static rtcan::service* g_b = nullptr;
+
+static volatile u32 g_a_to_b = 0;
+static volatile u32 g_b_to_a = 0;
+
+static void on_a_to_b(const rtcan::msg&, void*) { g_a_to_b = g_a_to_b + 1; }
+static void on_b_to_a(const rtcan::msg&, void*) { g_b_to_a = g_b_to_a + 1; }
+
+// keeps the source controller's tx queue topped up, backing off a tick
+// whenever it is full.
+static void producer_task(void* arg) {
+  auto* svc = static_cast<rtcan::service*>(arg);
+  const u32 base = (svc == g_a) ? A_BASE : B_BASE;
+  u32 n = 0;
+  while (true) {
+    rtcan::msg m{.id = base + (n % IDS), .dlc = 8};
+    m.data[0] = static_cast<u8>(n);
+    m.data[1] = static_cast<u8>(n >> 8);
+    if (svc->transmit(m))
+      ++n;
+    else
+      rtos::this_task::delay(1);
+  }
+}
+
+static void report(const char* dir, const rtcan::service::forward_status& s,
+                   u32 delivered, u32 per_sec) {
+  const u32 cycles_per_us = SystemCoreClock / 1'000'000;
+  log::info("%s: %lu/s delivered=%lu fwd=%lu drop=%lu fail=%lu", dir, per_sec,
+            delivered, s.forwarded, s.dropped, s.failed);
+  log::info("  latency p50=%luus p99=%luus worst=%luus",
+            s.latency.percentile(50) / cycles_per_us,
+            s.latency.percentile(99) / cycles_per_us,
+            s.latency.worst / cycles_per_us);
+}
+
+static void monitor_task(void*) {
+  u32 last_ab = 0;
+  u32 last_ba = 0;
+  while (true) {
+    rtos::this_task::delay_ms(1000);
+    const u32 ab = g_a_to_b;
+    const u32 ba = g_b_to_a;
+    report("can1->can2", g_a->forward_info(), ab, ab - last_ab);
+    report("can2->can1", g_b->forward_info(), ba, ba - last_ba);
+    last_ab = ab;
+    last_ba = ba;
+  }
+}
+
+int main() {
+  hal::system_init();
+  log::info("=== rtcan gateway ===");
+
+  rtcan::config cfg_a{};
+  cfg_a.loopback = true;
+  cfg_a.rate = rtcan::bitrate::k1000;
+  cfg_a.max_subscribers = IDS;
+
+  rtcan::config cfg_b = cfg_a;
+  cfg_b.instance = CAN2;
+  cfg_b.tx_port = GPIOB;
+  cfg_b.tx_pin = GPIO_PIN_6;
+  cfg_b.rx_port = GPIOB;
+  cfg_b.rx_pin = GPIO_PIN_5;
+  cfg_b.af = GPIO_AF9_CAN2;
+
+  static rtcan::service a{cfg_a};
+  static rtcan::service b{cfg_b};
+  g_a = &a;
+  g_b = &b;
+
+  // loopback hands every controller its own frames back, so each side
+  // only forwards the ids the other side doesn't produce.
+  static const rtcan::forward_rule a_to_b[] = {
+      {.id = A_DROPPED, .drop = true},
+      {.id = A_BASE, .mask = 0x7F0, .remap_mask = 0xF00, .remap_id = A_REMAP},
+  };
+  static const rtcan::forward_rule b_to_a[] = {
+      {.id = B_BASE, .mask = 0x7F0},
+  };
+  a.forward_to(b, a_to_b);
+  b.forward_to(a, b_to_a);
+
+  for (u32 i = 0; i < IDS; ++i) {
+    b.subscribe(A_REMAP + i, on_a_to_b);
+    a.subscribe(B_BASE + i, on_b_to_a);
+  }
+
+  if (!a.start() || !b.start()) {
+    log::error("gateway: start failed");
+  }
+
+  static rtos::task t_a{"prod_a", producer_task, &a, 256, 2};
+  static rtos::task t_b{"prod_b", producer_task, &b, 256, 2};
+  static rtos::task t_mon{"mon", monitor_task, nullptr, 512, 3};
+
+  static hal::output_pin led{GPIOB, GPIO_PIN_0};
+  static rtos::task heartbeat{"hb",
+                              [](void*) {
+                                while (true) {
+                                  led.toggle();
+                                  rtos::this_task::delay_ms(500);
+                                }
+                              },
+                              nullptr, 256, 1};
+
+  rtos::start_scheduler();
+  while (true) {
+  }
+}
@@ -4,9 +4,45 @@
 #include <jstm/log.hpp>
 #include <jstm/rtcan/rtcan.hpp>
 #include <jstm/rtos/rtos.hpp>
+#include <jstm/time.hpp>
 
 static jstm::rtcan::service* g_rtcan = nullptr;
 
+// flip to compare the freertos-queue rx path against the lock-free one.
+static constexpr bool use_lockfree_rx = true;
+
+struct isr_bench {
+  jstm::u32 frames = 0;
+  jstm::u32 cycles = 0;
+  jstm::u32 worst = 0;
+  jstm::u32 entry = 0;
+  jstm::u32 probe_entry = 0;
+};
+
+static isr_bench g_isr_bench;
+
+static constexpr jstm::u32 ISR_PROBE_ID = 0x050;
+static constexpr jstm::u32 QUEUE_PROBE_ID = 0x051;
+static constexpr jstm::u32 RTR_ID = 0x060;
+// extended 0x00000123 is subscribed, standard 0x123 is not: only the
+// extended frame may get through the filters.
+static constexpr jstm::u32 EXT_PROBE_ID = 0x123;
+
+static void timed_rx_isr(jstm::u32 fifo) {
+  const jstm::u32 start = jstm::cycle_count();
+  g_isr_bench.entry = start;
+
+  const jstm::u32 rir = g_rtcan->can_handle()->Instance->sFIFOMailBox[fifo].RIR;
+  if (!(rir & CAN_RI0R_IDE) && (rir >> CAN_RI0R_STID_Pos) == QUEUE_PROBE_ID)
+    g_isr_bench.probe_entry = start;
+
+  g_rtcan->handle_rx_isr(fifo);
+  const jstm::u32 elapsed = jstm::cycle_count() - start;
+  ++g_isr_bench.frames;
+  g_isr_bench.cycles += elapsed;
+  if (elapsed > g_isr_bench.worst) g_isr_bench.worst = elapsed;
+}
+
 extern "C" {
 
 void CAN1_TX_IRQHandler() { HAL_CAN_IRQHandler(g_rtcan->can_handle()); }
@@ -15,19 +51,28 @@ void CAN1_RX1_IRQHandler() { HAL_CAN_IRQHandler(g_rtcan->can_handle()); }
 void CAN1_SCE_IRQHandler() { HAL_CAN_IRQHandler(g_rtcan->can_handle()); }
 
 void HAL_CAN_TxMailbox0CompleteCallback(CAN_HandleTypeDef*) {
-  if (g_rtcan) g_rtcan->handle_tx_complete_isr();
+  if (g_rtcan) g_rtcan->handle_tx_complete_isr(0);
 }
 void HAL_CAN_TxMailbox1CompleteCallback(CAN_HandleTypeDef*) {
-  if (g_rtcan) g_rtcan->handle_tx_complete_isr();
+  if (g_rtcan) g_rtcan->handle_tx_complete_isr(1);
 }
 void HAL_CAN_TxMailbox2CompleteCallback(CAN_HandleTypeDef*) {
-  if (g_rtcan) g_rtcan->handle_tx_complete_isr();
+  if (g_rtcan) g_rtcan->handle_tx_complete_isr(2);
+}
+void HAL_CAN_TxMailbox0AbortCallback(CAN_HandleTypeDef*) {
+  if (g_rtcan) g_rtcan->handle_tx_abort_isr(0);
+}
+void HAL_CAN_TxMailbox1AbortCallback(CAN_HandleTypeDef*) {
+  if (g_rtcan) g_rtcan->handle_tx_abort_isr(1);
+}
+void HAL_CAN_TxMailbox2AbortCallback(CAN_HandleTypeDef*) {
+  if (g_rtcan) g_rtcan->handle_tx_abort_isr(2);
 }
 void HAL_CAN_RxFifo0MsgPendingCallback(CAN_HandleTypeDef*) {
-  if (g_rtcan) g_rtcan->handle_rx_isr(CAN_RX_FIFO0);
+  if (g_rtcan) timed_rx_isr(CAN_RX_FIFO0);
 }
 void HAL_CAN_RxFifo1MsgPendingCallback(CAN_HandleTypeDef*) {
-  if (g_rtcan) g_rtcan->handle_rx_isr(CAN_RX_FIFO1);
+  if (g_rtcan) timed_rx_isr(CAN_RX_FIFO1);
 }
 void HAL_CAN_ErrorCallback(CAN_HandleTypeDef*) {
   if (g_rtcan) g_rtcan->handle_error_isr();
@@ -43,11 +88,96 @@ struct stats {
   u32 rx_b = 0;
   u32 rx_multi = 0;
   u32 seq_err = 0;
+  u32 rx_gaps = 0;
   u32 data_err = 0;
 };
 
 static stats g_stats;
 
+struct latency {
+  u32 samples = 0;
+  u32 total = 0;
+  u32 worst = 0;
+
+  void add(u32 cycles) {
+    ++samples;
+    total += cycles;
+    if (cycles > worst) worst = cycles;
+  }
+
+  u32 avg() const { return samples ? total / samples : 0; }
+};
+
+static latency g_isr_path;
+static latency g_queue_path;
+static latency g_rx_path;
+static u32 g_rtr_replies = 0;
+static u32 g_ext_sent = 0;
+static u32 g_ext_rx = 0;
+static u32 g_ext_wrong = 0;
+
+static void estop_isr(const rtcan::msg&, void*) {
+  g_isr_path.add(cycle_count() - g_isr_bench.entry);
+}
+
+// runs in the rtcan rx thread, no queue or task needed.
+static volatile u16 g_setpoint_seen = 0;
+
+static void on_setpoint(const rtcan::msg& m, void*) {
+  g_setpoint_seen = static_cast<u16>(m.data[0] | (m.data[1] << 8));
+}
+
+static void setpoint_producer(void* arg) {
+  auto* svc = static_cast<rtcan::service*>(arg);
+  u16 setpoint = 0;
+
+  while (true) {
+    rtcan::msg m{.id = 0x180, .dlc = 2};
+    m.data[0] = static_cast<u8>(setpoint);
+    m.data[1] = static_cast<u8>(setpoint >> 8);
+    svc->transmit_latest(m);
+    ++setpoint;
+    rtos::this_task::delay(1);
+  }
+}
+
+static void probe_producer(void* arg) {
+  auto* svc = static_cast<rtcan::service*>(arg);
+  u32 n = 0;
+
+  while (true) {
+    svc->transmit(rtcan::msg{.id = ISR_PROBE_ID});
+    rtos::this_task::delay_ms(50);
+    svc->transmit(rtcan::msg{.id = QUEUE_PROBE_ID});
+    rtos::this_task::delay_ms(50);
+
+    if (++n % 10 == 0) svc->transmit(rtcan::msg{.id = RTR_ID, .rtr = true});
+
+    if (svc->transmit(rtcan::msg{.id = EXT_PROBE_ID, .extended = true}))
+      ++g_ext_sent;
+    svc->transmit(rtcan::msg{.id = EXT_PROBE_ID});
+  }
+}
+
+static void probe_listener(void* arg) {
+  auto* q = static_cast<rtos::queue<const rtcan::msg*>*>(arg);
+
+  while (true) {
+    const rtcan::msg* m = nullptr;
+    if (q->receive(m, pdMS_TO_TICKS(200))) {
+      if (m->id == QUEUE_PROBE_ID)
+        g_queue_path.add(cycle_count() - g_isr_bench.probe_entry);
+      else if (m->id == RTR_ID)
+        ++g_rtr_replies;
+      else if (m->id == EXT_PROBE_ID && m->extended)
+        ++g_ext_rx;
+      else if (m->id == EXT_PROBE_ID)
+        ++g_ext_wrong;
+      g_rtcan->msg_consumed(m);
+    }
+  }
+}
+
 static void multi_id_producer(void* arg) {
   auto* svc = static_cast<rtcan::service*>(arg);
   u32 seq = 0;
@@ -79,10 +209,14 @@ static void multi_id_producer(void* arg) {
 static void subscriber_a(void* arg) {
   auto* q = static_cast<rtos::queue<const rtcan::msg*>*>(arg);
   u32 last_seq_100 = 0xFFFFFFFF;
+  u16 last_rx_seq_100 = 0;
+  bool have_rx_seq_100 = false;
 
   while (true) {
     const rtcan::msg* m = nullptr;
     if (q->receive(m, pdMS_TO_TICKS(200))) {
+      g_rx_path.add(cycle_count() - m->timestamp);
+
       u32 seq = m->data[0] | (m->data[1] << 8) | (m->data[2] << 16) |
                 (m->data[3] << 24);
 
@@ -92,6 +226,11 @@ static void subscriber_a(void* arg) {
         if (last_seq_100 != 0xFFFFFFFF && seq != last_seq_100 + 1)
           ++g_stats.seq_err;
         last_seq_100 = seq;
+
+        if (have_rx_seq_100 && static_cast<u16>(m->seq - last_rx_seq_100) != 1)
+          ++g_stats.rx_gaps;
+        last_rx_seq_100 = m->seq;
+        have_rx_seq_100 = true;
       }
 
       ++g_stats.rx_a;
@@ -184,7 +323,8 @@ static void lifecycle_test(void* arg) {
 
 int main() {
   hal::system_init();
-  log::info("=== rtcan stress test ===");
+  log::info("=== rtcan stress test (%s rx path) ===",
+            use_lockfree_rx ? "lock-free" : "queue");
 
   rtcan::config cfg{};
   cfg.instance = CAN1;
@@ -199,6 +339,8 @@ int main() {
   cfg.rx_pool_size = 64;
   cfg.hashmap_size = 32;
   cfg.max_subscribers = 32;
+  cfg.latest_ids = 4;
+  cfg.lockfree_rx = use_lockfree_rx;
 
   static rtcan::service svc{cfg};
   g_rtcan = &svc;
@@ -213,6 +355,19 @@ int main() {
   svc.subscribe(0x200, q_b);
   svc.subscribe(0x100, q_multi);
 
+  static rtos::queue<const rtcan::msg*> q_probe{8};
+  svc.subscribe(QUEUE_PROBE_ID, q_probe);
+  svc.subscribe(RTR_ID, q_probe);
+  svc.subscribe(rtcan::extended_id(EXT_PROBE_ID), q_probe);
+  svc.register_isr_handler(ISR_PROBE_ID, estop_isr);
+  svc.subscribe(0x180, on_setpoint, nullptr, 5);
+  svc.cache_latest(0x300);
+
+  static const rtcan::msg rtr_table[] = {
+      {.id = RTR_ID, .data = {0x5A, 0xA5}, .dlc = 2},
+  };
+  svc.set_rtr_responses(rtr_table);
+
   log::info("subscribers: 0x100=%u 0x200=%u 0x300=%u",
             svc.subscriber_count(0x100), svc.subscriber_count(0x200),
             svc.subscriber_count(0x300));
@@ -230,6 +385,9 @@ int main() {
   static rtos::task t_multi{"multi", multi_sub_listener, &q_multi, 512, 2};
   static rtos::task t_burst{"burst", burst_producer, &svc, 512, 3};
   static rtos::task t_life{"lifecycle", lifecycle_test, &svc, 512, 2};
+  static rtos::task t_probe{"probe", probe_producer, &svc, 512, 3};
+  static rtos::task t_setpoint{"setpoint", setpoint_producer, &svc, 256, 3};
+  static rtos::task t_probe_rx{"probe_rx", probe_listener, &q_probe, 512, 2};
 
   static hal::output_pin led{GPIOB, GPIO_PIN_0};
 
@@ -241,14 +399,88 @@ int main() {
                                   auto e = g_rtcan->error();
                                   log::info(
                                       "--- tx=%lu/%lu rx_a=%lu rx_b=%lu "
-                                      "multi=%lu seq_err=%lu data_err=%lu "
-                                      "err=0x%04lX ---",
+                                      "multi=%lu seq_err=%lu gaps=%lu "
+                                      "data_err=%lu err=0x%04lX ---",
                                       g_stats.tx_ok, g_stats.tx_fail,
                                       g_stats.rx_a, g_stats.rx_b,
                                       g_stats.rx_multi, g_stats.seq_err,
-                                      g_stats.data_err, static_cast<u32>(e));
+                                      g_stats.rx_gaps, g_stats.data_err,
+                                      static_cast<u32>(e));
                                   if (e != rtcan::rtcan_error::none)
                                     g_rtcan->clear_error();
+                                  if (g_isr_bench.frames > 0) {
+                                    log::info(
+                                        "rx isr: frames=%lu avg=%lu "
+                                        "worst=%lu cycles",
+                                        g_isr_bench.frames,
+                                        g_isr_bench.cycles /
+                                            g_isr_bench.frames,
+                                        g_isr_bench.worst);
+                                  }
+                                  log::info(
+                                      "latency: isr handler avg=%lu "
+                                      "worst=%lu, queue path avg=%lu "
+                                      "worst=%lu, sub_a avg=%lu worst=%lu "
+                                      "cycles, rtr replies=%lu",
+                                      g_isr_path.avg(), g_isr_path.worst,
+                                      g_queue_path.avg(), g_queue_path.worst,
+                                      g_rx_path.avg(), g_rx_path.worst,
+                                      g_rtr_replies);
+                                  // one probe may still be in flight
+                                  const bool ext_ok =
+                                      g_ext_rx + 1 >= g_ext_sent &&
+                                      g_ext_wrong == 0;
+                                  log::info(
+                                      "extended 0x%08lX: sent=%lu rx=%lu "
+                                      "standard leaked=%lu %s",
+                                      EXT_PROBE_ID, g_ext_sent, g_ext_rx,
+                                      g_ext_wrong, ext_ok ? "ok" : "FAIL");
+                                  rtcan::service::callback_status cb[1];
+                                  if (g_rtcan->callback_info(cb) == 1) {
+                                    log::info(
+                                        "callback 0x180: setpoint=%u "
+                                        "calls=%lu worst=%lu/%lu cycles "
+                                        "overruns=%lu%s",
+                                        g_setpoint_seen, cb[0].calls,
+                                        cb[0].worst_cycles,
+                                        cb[0].budget_cycles, cb[0].overruns,
+                                        cb[0].disabled ? " (disabled)" : "");
+                                  }
+                                  rtcan::msg last;
+                                  u32 age = 0;
+                                  if (g_rtcan->latest(0x300, last, age)) {
+                                    log::info(
+                                        "latest 0x300: dlc=%u d0=0x%02X "
+                                        "age=%lu ticks",
+                                        last.dlc, last.data[0], age);
+                                  }
+                                  auto ts = g_rtcan->traffic_info();
+                                  log::info(
+                                      "traffic: rx p50=%lu p99=%lu "
+                                      "tx p99=%lu cycles, pool=%lu "
+                                      "drops=%lu ovr=%lu/%lu",
+                                      ts.rx_latency.percentile(50),
+                                      ts.rx_latency.percentile(99),
+                                      ts.tx_wait.percentile(99),
+                                      ts.pool_exhausted, ts.queue_drops,
+                                      ts.fifo_overruns[0],
+                                      ts.fifo_overruns[1]);
+                                  auto f = g_rtcan->filter_info();
+                                  log::info(
+                                      "filters: banks=%u coarse=%u "
+                                      "accepted=%lu unrouted=%lu",
+                                      f.banks, f.coarse_bits, f.accepted,
+                                      f.unrouted);
+                                  auto t = g_rtcan->tx_info();
+                                  log::info(
+                                      "tx worst wait (cycles): c0=%lu "
+                                      "c1=%lu c2=%lu c3=%lu preempt=%lu "
+                                      "coalesced=%lu direct=%lu",
+                                      t.classes[0].worst_cycles,
+                                      t.classes[1].worst_cycles,
+                                      t.classes[2].worst_cycles,
+                                      t.classes[3].worst_cycles,
+                                      t.preemptions, t.coalesced, t.direct);
                                   rtos::this_task::delay_ms(2000);
                                 }
                               },
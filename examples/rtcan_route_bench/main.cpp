@@ -0,0 +1,231 @@
+#include <jstm/hal/gpio.hpp>
+#include <jstm/hal/hal.hpp>
+#include <jstm/log.hpp>
+#include <jstm/rtcan/rtcan.hpp>
+#include <jstm/rtcan/static_service.hpp>
+#include <jstm/rtos/rtos.hpp>
+#include <jstm/time.hpp>
+#include <utility>
+
+using namespace jstm;
+
+static constexpr u16 STD_IDS = 200;
+static constexpr u16 EXT_IDS = 24;
+static constexpr u16 ROUTES = STD_IDS + EXT_IDS;
+static constexpr u16 SUBS_PER_ID = 3;
+static constexpr u16 MAP_SIZE = 256;
+static constexpr u32 ROUNDS = 50;
+
+// a spread of standard ids plus some j1939-style extended ids, so both
+// the direct-indexed and the hashed path get exercised.
+static constexpr u32 route_id(u16 i) {
+  if (i < STD_IDS) return 0x080 + i * 7;
+  return 0x18FF'0000u | (static_cast<u32>(i - STD_IDS) << 8) | 0x21;
+}
+
+static u32 g_ids[ROUTES];
+
+static rtos::queue<const rtcan::msg*> g_q0{4};
+static rtos::queue<const rtcan::msg*> g_q1{4};
+static rtos::queue<const rtcan::msg*> g_q2{4};
+
+// the same routes fixed at build time, one static_route per id.
+template <typename Seq>
+struct static_routes;
+
+template <u16... I>
+struct static_routes<std::integer_sequence<u16, I...>> {
+  using service = rtcan::static_service<
+      rtcan::static_route<route_id(I), &g_q0, &g_q1, &g_q2>...>;
+};
+
+using static_bench_service =
+    static_routes<std::make_integer_sequence<u16, ROUTES>>::service;
+
+// the routing layout rtcan used before the flat table: a chained hashmap
+// whose collisions scan the whole map for a free slot, with a linked list
+// of subscribers per slot. kept here only to measure against.
+class legacy_routes {
+ public:
+  void subscribe(u32 can_id, rtos::queue<const rtcan::msg*>* q) {
+    slot* s = find_or_create(can_id);
+    if (!s || next_sub_ >= MAX_SUBS) return;
+
+    const u16 si = next_sub_++;
+    subs_[si] = {q, INVALID};
+    if (s->first == INVALID) {
+      s->first = si;
+      return;
+    }
+    u16 cur = s->first;
+    while (subs_[cur].next != INVALID) cur = subs_[cur].next;
+    subs_[cur].next = si;
+  }
+
+  // what rx_thread_entry did per frame before the fan-out itself.
+  u16 count(u32 can_id) const {
+    const slot* cur = &map_[hash(can_id) % MAP_SIZE];
+    if (!cur->occupied) return 0;
+    while (cur->can_id != can_id) {
+      if (cur->chain == INVALID) return 0;
+      cur = &map_[cur->chain];
+    }
+    u16 n = 0;
+    for (u16 si = cur->first; si != INVALID; si = subs_[si].next) ++n;
+    return n;
+  }
+
+ private:
+  static constexpr u16 INVALID = 0xFFFF;
+  static constexpr u16 MAX_SUBS = ROUTES * SUBS_PER_ID;
+
+  struct slot {
+    u32 can_id = 0;
+    bool occupied = false;
+    u16 first = INVALID;
+    u16 chain = INVALID;
+  };
+
+  struct sub {
+    rtos::queue<const rtcan::msg*>* q = nullptr;
+    u16 next = INVALID;
+  };
+
+  static u32 hash(u32 key) {
+    u32 h = key;
+    h += (h << 12);
+    h ^= (h >> 22);
+    h += (h << 4);
+    h ^= (h >> 9);
+    h += (h << 10);
+    h ^= (h >> 2);
+    h += (h << 7);
+    h ^= (h >> 12);
+    return h;
+  }
+
+  slot* find_or_create(u32 can_id) {
+    slot* cur = &map_[hash(can_id) % MAP_SIZE];
+    if (!cur->occupied) {
+      *cur = {.can_id = can_id, .occupied = true};
+      return cur;
+    }
+    while (true) {
+      if (cur->can_id == can_id) return cur;
+      if (cur->chain == INVALID) break;
+      cur = &map_[cur->chain];
+    }
+    for (u16 i = 0; i < MAP_SIZE; ++i) {
+      if (!map_[i].occupied) {
+        map_[i] = {.can_id = can_id, .occupied = true};
+        cur->chain = i;
+        return &map_[i];
+      }
+    }
+    return nullptr;
+  }
+
+  slot map_[MAP_SIZE]{};
+  sub subs_[MAX_SUBS]{};
+  u16 next_sub_ = 0;
+};
+
+struct bench {
+  u32 total = 0;
+  u32 worst = 0;
+  u32 samples = 0;
+
+  template <typename F>
+  void run(F&& lookup) {
+    for (u32 round = 0; round < ROUNDS; ++round) {
+      for (u16 i = 0; i < ROUTES; ++i) {
+        const u32 start = cycle_count();
+        lookup(g_ids[i]);
+        const u32 elapsed = cycle_count() - start;
+        total += elapsed;
+        if (elapsed > worst) worst = elapsed;
+        ++samples;
+      }
+    }
+  }
+
+  u32 avg() const { return samples ? total / samples : 0; }
+};
+
+static legacy_routes g_legacy;
+static rtcan::service* g_rtcan = nullptr;
+static static_bench_service* g_static = nullptr;
+static volatile u32 g_sink = 0;
+
+static void bench_task(void*) {
+  bench old_path;
+  bench new_path;
+  bench static_path;
+
+  {
+    rtos::scheduler_lock lock;
+    old_path.run([](u32 id) { g_sink = g_legacy.count(id); });
+    new_path.run([](u32 id) { g_sink = g_rtcan->subscriber_count(id); });
+    static_path.run([](u32 id) { g_sink = g_static->subscriber_count(id); });
+  }
+
+  log::info("route lookup over %u ids x %u subscribers:", ROUTES,
+            SUBS_PER_ID);
+  log::info("  chained hashmap: avg=%lu worst=%lu cycles", old_path.avg(),
+            old_path.worst);
+  log::info("  flat table:      avg=%lu worst=%lu cycles", new_path.avg(),
+            new_path.worst);
+  log::info("  static service:  avg=%lu worst=%lu cycles (%s)",
+            static_path.avg(), static_path.worst,
+            static_bench_service::perfect_hashed() ? "perfect hash"
+                                                   : "binary search");
+
+  rtos::this_task::suspend();
+}
+
+int main() {
+  hal::system_init();
+  log::info("=== rtcan route lookup bench ===");
+
+  rtcan::config cfg{};
+  cfg.loopback = true;
+  cfg.hashmap_size = MAP_SIZE;
+  cfg.max_subscribers = ROUTES * SUBS_PER_ID;
+
+  static rtcan::service svc{cfg};
+  g_rtcan = &svc;
+
+  // never started, only its route lookup is timed. it sits on can2 so it
+  // doesn't take can1's isr slot from svc.
+  rtcan::config static_cfg = cfg;
+  static_cfg.instance = CAN2;
+  static static_bench_service static_svc{static_cfg};
+  g_static = &static_svc;
+
+  rtos::queue<const rtcan::msg*>* queues[SUBS_PER_ID] = {&g_q0, &g_q1,
+                                                          &g_q2};
+  for (u16 i = 0; i < ROUTES; ++i) g_ids[i] = route_id(i);
+
+  for (u16 i = 0; i < ROUTES; ++i) {
+    for (u16 s = 0; s < SUBS_PER_ID; ++s) {
+      g_legacy.subscribe(g_ids[i], queues[s]);
+      svc.subscribe(g_ids[i], *queues[s]);
+    }
+  }
+
+  static rtos::task t_bench{"bench", bench_task, nullptr, 512, 2};
+
+  static hal::output_pin led{GPIOB, GPIO_PIN_0};
+  static rtos::task heartbeat{"hb",
+                              [](void*) {
+                                while (true) {
+                                  led.toggle();
+                                  rtos::this_task::delay_ms(500);
+                                }
+                              },
+                              nullptr, 256, 1};
+
+  rtos::start_scheduler();
+  while (true) {
+  }
+}
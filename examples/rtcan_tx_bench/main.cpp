@@ -0,0 +1,173 @@
+#include <jstm/hal/gpio.hpp>
+#include <jstm/hal/hal.hpp>
+#include <jstm/log.hpp>
+#include <jstm/rtcan/rtcan.hpp>
+#include <jstm/rtos/rtos.hpp>
+#include <jstm/time.hpp>
+
+static jstm::rtcan::service* g_rtcan = nullptr;
+
+extern "C" {
+
+void CAN1_TX_IRQHandler() { HAL_CAN_IRQHandler(g_rtcan->can_handle()); }
+void CAN1_RX0_IRQHandler() { HAL_CAN_IRQHandler(g_rtcan->can_handle()); }
+void CAN1_RX1_IRQHandler() { HAL_CAN_IRQHandler(g_rtcan->can_handle()); }
+void CAN1_SCE_IRQHandler() { HAL_CAN_IRQHandler(g_rtcan->can_handle()); }
+
+void HAL_CAN_TxMailbox0CompleteCallback(CAN_HandleTypeDef*) {
+  if (g_rtcan) g_rtcan->handle_tx_complete_isr(0);
+}
+void HAL_CAN_TxMailbox1CompleteCallback(CAN_HandleTypeDef*) {
+  if (g_rtcan) g_rtcan->handle_tx_complete_isr(1);
+}
+void HAL_CAN_TxMailbox2CompleteCallback(CAN_HandleTypeDef*) {
+  if (g_rtcan) g_rtcan->handle_tx_complete_isr(2);
+}
+void HAL_CAN_TxMailbox0AbortCallback(CAN_HandleTypeDef*) {
+  if (g_rtcan) g_rtcan->handle_tx_abort_isr(0);
+}
+void HAL_CAN_TxMailbox1AbortCallback(CAN_HandleTypeDef*) {
+  if (g_rtcan) g_rtcan->handle_tx_abort_isr(1);
+}
+void HAL_CAN_TxMailbox2AbortCallback(CAN_HandleTypeDef*) {
+  if (g_rtcan) g_rtcan->handle_tx_abort_isr(2);
+}
+void HAL_CAN_RxFifo0MsgPendingCallback(CAN_HandleTypeDef*) {
+  if (g_rtcan) g_rtcan->handle_rx_isr(CAN_RX_FIFO0);
+}
+void HAL_CAN_RxFifo1MsgPendingCallback(CAN_HandleTypeDef*) {
+  if (g_rtcan) g_rtcan->handle_rx_isr(CAN_RX_FIFO1);
+}
+void HAL_CAN_ErrorCallback(CAN_HandleTypeDef*) {
+  if (g_rtcan) g_rtcan->handle_error_isr();
+}
+}
+
+using namespace jstm;
+
+static constexpr u32 BENCH_ID = 0x200;
+static constexpr u16 GROUP = 20;
+static constexpr u32 GROUPS = 250;
+static constexpr u32 FRAMES = GROUP * GROUPS;
+
+static volatile u32 g_received = 0;
+
+static void on_frame(const rtcan::msg&, void*) { g_received = g_received + 1; }
+
+struct run_result {
+  u32 frames_per_sec = 0;
+  u32 cycles_per_frame = 0;
+  u32 retries = 0;
+};
+
+static void fill_group(rtcan::msg (&group)[GROUP], u32 g) {
+  for (u16 i = 0; i < GROUP; ++i) {
+    group[i] = {.id = BENCH_ID, .dlc = 8};
+    group[i].data[0] = static_cast<u8>(g);
+    group[i].data[1] = static_cast<u8>(g >> 8);
+    group[i].data[2] = static_cast<u8>(i);
+  }
+}
+
+// sends GROUPS bursts of GROUP frames and times them until the last one
+// comes back through loopback. a full tx queue backs off one tick.
+template <typename Send>
+static run_result run(Send&& send) {
+  run_result r{};
+  rtcan::msg group[GROUP];
+  u32 cycles = 0;
+
+  g_received = 0;
+  const u32 start = rtos::tick_count();
+  for (u32 g = 0; g < GROUPS; ++g) {
+    fill_group(group, g);
+    u16 done = 0;
+    while (done < GROUP) {
+      const u32 t0 = cycle_count();
+      const u16 n = send(std::span<const rtcan::msg>{group}.subspan(done));
+      cycles += cycle_count() - t0;
+      done += n;
+      if (done < GROUP) {
+        ++r.retries;
+        rtos::this_task::delay(1);
+      }
+    }
+  }
+  while (g_received < FRAMES) rtos::this_task::delay(1);
+
+  const u32 ticks = rtos::tick_count() - start;
+  r.frames_per_sec = ticks ? FRAMES * configTICK_RATE_HZ / ticks : 0;
+  r.cycles_per_frame = cycles / FRAMES;
+  return r;
+}
+
+static u16 send_single(std::span<const rtcan::msg> frames) {
+  u16 n = 0;
+  for (const rtcan::msg& m : frames) {
+    if (!g_rtcan->transmit(m)) break;
+    ++n;
+  }
+  return n;
+}
+
+static u16 send_batch(std::span<const rtcan::msg> frames) {
+  auto r = g_rtcan->transmit_batch(frames, rtcan::batch_mode::best_effort);
+  return r ? *r : 0;
+}
+
+static void bench_rate(rtcan::bitrate rate, const char* name) {
+  rtcan::config cfg{};
+  cfg.loopback = true;
+  cfg.rate = rate;
+  cfg.tx_queue_depth = 64;
+
+  auto* svc = new rtcan::service{cfg};
+  svc->subscribe(BENCH_ID, on_frame);
+  g_rtcan = svc;
+  if (!svc->start()) {
+    log::error("%s: start failed", name);
+    g_rtcan = nullptr;
+    delete svc;
+    return;
+  }
+
+  const run_result single = run(send_single);
+  const run_result batch = run(send_batch);
+
+  log::info("%s, %lu frames in groups of %u:", name, FRAMES, GROUP);
+  log::info("  transmit():       %lu frames/s, %lu cycles/frame, %lu retries",
+            single.frames_per_sec, single.cycles_per_frame, single.retries);
+  log::info("  transmit_batch(): %lu frames/s, %lu cycles/frame, %lu retries",
+            batch.frames_per_sec, batch.cycles_per_frame, batch.retries);
+
+  svc->stop();
+  g_rtcan = nullptr;
+  delete svc;
+}
+
+static void bench_task(void*) {
+  bench_rate(rtcan::bitrate::k500, "500k");
+  bench_rate(rtcan::bitrate::k1000, "1M");
+  rtos::this_task::suspend();
+}
+
+int main() {
+  hal::system_init();
+  log::info("=== rtcan tx throughput bench ===");
+
+  static rtos::task t_bench{"bench", bench_task, nullptr, 1024, 3};
+
+  static hal::output_pin led{GPIOB, GPIO_PIN_0};
+  static rtos::task heartbeat{"hb",
+                              [](void*) {
+                                while (true) {
+                                  led.toggle();
+                                  rtos::this_task::delay_ms(500);
+                                }
+                              },
+                              nullptr, 256, 1};
+
+  rtos::start_scheduler();
+  while (true) {
+  }
+}
@@ -0,0 +1,137 @@
+#pragma once
+
+#include <jstm/result.hpp>
+#include <jstm/rtcan/rtcan.hpp>
+#include <jstm/types.hpp>
+#include <span>
+
+namespace jstm::rtcan {
+
+// one captured frame or bus error, exactly as it appears in a dump
+// (little endian, no padding).
+struct capture_record {
+  u32 timestamp = 0;  // dwt cycle count, as msg::timestamp
+  u32 id = 0;         // can id, or HAL_CAN_GetError() bits for errors
+  u16 tick = 0;       // low bits of the rtos tick, to unwrap timestamp
+  u8 dlc = 0;
+  u8 flags = 0;  // capture_flags
+  u8 data[8]{};  // payload, or the esr register for errors
+};
+
+static_assert(sizeof(capture_record) == 20);
+
+namespace capture_flags {
+inline constexpr u8 extended = 0x01;
+inline constexpr u8 rtr = 0x02;
+inline constexpr u8 error = 0x04;
+inline constexpr u8 trigger = 0x08;  // the record that fired the trigger
+inline constexpr u8 can2 = 0x10;     // recorded on CAN2, else on CAN1
+}  // namespace capture_flags
+
+// what ends the pre-trigger window. a frame matches an id trigger when
+// (id ^ t.id) & t.id_mask is zero, and a payload trigger when it also
+// has at least the masked bytes and they match.
+struct capture_trigger {
+  enum class kind : u8 { manual, id, payload, error };
+
+  kind k = kind::manual;
+  u32 id = 0;
+  u32 id_mask = 0x1FFF'FFFF;
+  u8 data[8]{};
+  u8 data_mask[8]{};
+};
+
+inline constexpr capture_trigger trigger_on_id(u32 id,
+                                               u32 mask = 0x1FFF'FFFF) {
+  return {.k = capture_trigger::kind::id, .id = id, .id_mask = mask};
+}
+
+capture_trigger trigger_on_payload(u32 id, std::span<const u8> data,
+                                   std::span<const u8> mask);
+
+inline constexpr capture_trigger trigger_on_error() {
+  return {.k = capture_trigger::kind::error};
+}
+
+// what dump() writes ahead of the records.
+struct capture_header {
+  u32 magic = 0x50'41'43'52;  // "RCAP"
+  u16 version = 1;
+  u16 record_size = sizeof(capture_record);
+  u32 count = 0;
+  u32 trigger = 0xFFFF'FFFF;  // index of the trigger record, if any
+  u32 core_hz = 0;
+  u32 tick_hz = 0;
+  u32 reserved[2]{};
+};
+
+static_assert(sizeof(capture_header) == 32);
+
+// passive capture ring filled from the rx isr of every service it is
+// attached to, with no task and no copy beyond the record itself. the
+// storage is the caller's, so it can live in sram1:
+//
+//   __attribute__((section(".sram1_bss")))
+//   static rtcan::capture_record ring[8192];
+//   static rtcan::capture cap{ring};
+//
+//   svc.attach_capture(cap);
+//   cap.arm(rtcan::trigger_on_id(0x18FECA00, 0x00FFFF00), 6000, 2000);
+//
+// once armed it overwrites the oldest record until the trigger fires,
+// then keeps `post` more records and stops, leaving the `pre` records
+// before the trigger intact.
+class capture {
+ public:
+  enum class state : u8 { idle, armed, triggered, done };
+
+  explicit capture(std::span<capture_record> ring);
+
+  capture(const capture&) = delete;
+  capture& operator=(const capture&) = delete;
+
+  // pre + post + 1 must fit in the ring.
+  result<void> arm(const capture_trigger& t, u32 pre, u32 post);
+
+  // fires the trigger now, from a task, whatever kind was armed.
+  void trigger();
+
+  // stops recording. what has been captured stays readable.
+  void stop();
+
+  state status() const { return state_; }
+
+  // the captured window, oldest first. read it once done or stopped.
+  u32 size() const;
+  u32 read(std::span<capture_record> out, u32 offset = 0) const;
+  u32 trigger_index() const;
+
+  using writer = void (*)(const void* data, u32 len, void* ctx);
+
+  // writes a capture_header and then every record in the window.
+  void dump(writer w, void* ctx) const;
+
+  // called by service from its rx and error isrs. can2 says which
+  // controller the record came from.
+  void record_isr(const msg& m, bool can2);
+  void record_error_isr(u32 error, u32 esr, u32 timestamp, bool can2);
+
+ private:
+  void push_isr(const capture_record& r, bool hit);
+  bool matches(const msg& m) const;
+  u32 first() const;
+
+  capture_record* ring_ = nullptr;
+  u32 capacity_ = 0;
+  capture_trigger trigger_{};
+  u32 pre_ = 0;
+  u32 post_ = 0;
+
+  volatile state state_ = state::idle;
+  volatile u32 head_ = 0;  // records written since arm()
+  u32 trigger_seq_ = 0;
+  bool triggered_ = false;
+  u32 remaining_ = 0;
+};
+
+}  // namespace jstm::rtcan
@@ -0,0 +1,342 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <jstm/result.hpp>
+#include <jstm/types.hpp>
+#include <span>
+
+namespace jstm::rtcan {
+
+inline constexpr u32 MAX_STD_ID = 0x7FF;
+inline constexpr u32 MAX_EXT_ID = 0x1FFF'FFFF;
+inline constexpr u8 FILTER_BANKS_PER_CAN = 14;
+
+struct filter_key {
+  u32 id = 0;
+  bool extended = false;
+  bool rtr = false;
+
+  constexpr bool operator==(const filter_key&) const = default;
+};
+
+// a block of ids of one format: those where (id & mask) == (this id &
+// mask). remote and data frames both pass.
+struct filter_mask {
+  u32 id = 0;
+  u32 mask = 0;
+  bool extended = false;
+
+  constexpr bool operator==(const filter_mask&) const = default;
+
+  constexpr bool covers(const filter_key& k) const {
+    return k.extended == extended && ((k.id ^ id) & mask) == 0;
+  }
+};
+
+// routes, isr handlers, cached frames and rate limits are keyed on the id
+// and its format: the id, with EXTENDED_FLAG set for an extended frame. a
+// number above 0x7ff can only be extended, so it gets the flag on its
+// own; an extended id of 0x7ff or below has to be named extended_id(id).
+inline constexpr u32 EXTENDED_FLAG = 0x8000'0000;
+
+inline constexpr u32 extended_id(u32 id) { return id | EXTENDED_FLAG; }
+
+inline constexpr u32 id_key(u32 can_id) {
+  return can_id > MAX_STD_ID ? can_id | EXTENDED_FLAG : can_id;
+}
+
+inline constexpr u32 key_id(u32 key) { return key & ~EXTENDED_FLAG; }
+
+inline constexpr filter_key key_filter(u32 key) {
+  return {key_id(key), (key & EXTENDED_FLAG) != 0};
+}
+
+// the smallest mask block holding every key in [lo, hi], both of one
+// format: exact for an aligned power-of-two run, a superset otherwise.
+inline constexpr filter_mask range_filter(u32 lo, u32 hi) {
+  const bool ext = (lo & EXTENDED_FLAG) != 0;
+  const u32 width = ext ? MAX_EXT_ID : MAX_STD_ID;
+  const u32 spread = key_id(lo) ^ key_id(hi);
+  const u32 mask = width & ~((1u << std::bit_width(spread)) - 1);
+  return {key_id(lo) & mask, mask, ext};
+}
+
+// one bxcan filter bank, laid out the way HAL_CAN_ConfigFilter wants it.
+struct filter_bank {
+  bool list = true;
+  bool wide = false;
+  u8 fifo = 0;
+  u16 id_high = 0;
+  u16 id_low = 0;
+  u16 mask_high = 0;
+  u16 mask_low = 0;
+
+  constexpr bool operator==(const filter_bank&) const = default;
+};
+
+struct filter_plan {
+  filter_bank banks[FILTER_BANKS_PER_CAN]{};
+  u8 count = 0;
+  u8 coarse_bits = 0;
+  bool accept_all = false;
+};
+
+namespace detail {
+
+inline constexpr u16 STD_RTR = 1 << 4;
+inline constexpr u16 STD_IDE = 1 << 3;
+inline constexpr u32 EXT_IDE = 1 << 2;
+inline constexpr u32 EXT_RTR = 1 << 1;
+
+class filter_packer {
+ public:
+  constexpr filter_packer(filter_plan& plan, u8 max_banks)
+      : plan_{plan}, max_banks_{max_banks} {}
+
+  constexpr bool std_list(u16 reg) {
+    std_list_[std_list_n_++] = reg;
+    if (std_list_n_ < 4) return true;
+    std_list_n_ = 0;
+    return emit({.list = true,
+                 .wide = false,
+                 .id_high = std_list_[2],
+                 .id_low = std_list_[0],
+                 .mask_high = std_list_[3],
+                 .mask_low = std_list_[1]});
+  }
+
+  constexpr bool std_mask(u16 reg, u16 mask) {
+    std_mask_[std_mask_n_++] = {reg, mask};
+    if (std_mask_n_ < 2) return true;
+    std_mask_n_ = 0;
+    return emit({.list = false,
+                 .wide = false,
+                 .id_high = std_mask_[1].reg,
+                 .id_low = std_mask_[0].reg,
+                 .mask_high = std_mask_[1].mask,
+                 .mask_low = std_mask_[0].mask});
+  }
+
+  constexpr bool ext_list(u32 reg) {
+    ext_list_[ext_list_n_++] = reg;
+    if (ext_list_n_ < 2) return true;
+    ext_list_n_ = 0;
+    return emit(wide_bank(true, ext_list_[0], ext_list_[1]));
+  }
+
+  constexpr bool ext_mask(u32 reg, u32 mask) {
+    return emit(wide_bank(false, reg, mask));
+  }
+
+  constexpr bool flush() {
+    while (std_list_n_ != 0) {
+      if (!std_list(std_list_[0])) return false;
+    }
+    if (std_mask_n_ != 0 && !std_mask(std_mask_[0].reg, std_mask_[0].mask))
+      return false;
+    if (ext_list_n_ != 0 && !ext_list(ext_list_[0])) return false;
+    return true;
+  }
+
+ private:
+  struct pair16 {
+    u16 reg = 0;
+    u16 mask = 0;
+  };
+
+  static constexpr filter_bank wide_bank(bool list, u32 r1, u32 r2) {
+    return {.list = list,
+            .wide = true,
+            .id_high = static_cast<u16>(r1 >> 16),
+            .id_low = static_cast<u16>(r1 & 0xFFFF),
+            .mask_high = static_cast<u16>(r2 >> 16),
+            .mask_low = static_cast<u16>(r2 & 0xFFFF)};
+  }
+
+  constexpr bool emit(const filter_bank& b) {
+    if (plan_.count >= max_banks_) return false;
+    plan_.banks[plan_.count++] = b;
+    return true;
+  }
+
+  filter_plan& plan_;
+  u8 max_banks_;
+  u16 std_list_[4]{};
+  u8 std_list_n_ = 0;
+  pair16 std_mask_[2]{};
+  u8 std_mask_n_ = 0;
+  u32 ext_list_[2]{};
+  u8 ext_list_n_ = 0;
+};
+
+inline constexpr u16 std_reg(u32 id, bool rtr) {
+  return static_cast<u16>((id << 5) | (rtr ? STD_RTR : 0));
+}
+
+inline constexpr u32 ext_reg(u32 id, bool rtr) {
+  return (id << 3) | EXT_IDE | (rtr ? EXT_RTR : 0);
+}
+
+// largest aligned power-of-two run of consecutive data ids starting at i.
+inline constexpr usize aligned_run(std::span<const filter_key> keys, usize i) {
+  const filter_key& k = keys[i];
+  usize best = 1;
+  for (usize len = 2; len <= 1024; len <<= 1) {
+    if (k.id % len != 0 || i + len > keys.size()) break;
+    const filter_key& last = keys[i + len - 1];
+    if (last.extended != k.extended || last.rtr || last.id != k.id + len - 1)
+      break;
+    best = len;
+  }
+  return best;
+}
+
+inline constexpr bool pack_mask(const filter_mask& m, filter_packer& p) {
+  const u32 id = m.id & m.mask;
+  return m.extended ? p.ext_mask(ext_reg(id, false), ext_reg(m.mask, false))
+                    : p.std_mask(std_reg(id, false),
+                                 std_reg(m.mask, false) | STD_IDE);
+}
+
+inline constexpr bool pack_exact(std::span<const filter_key> keys,
+                                 std::span<const filter_mask> masks,
+                                 filter_packer& p) {
+  for (const filter_mask& m : masks) {
+    if (!pack_mask(m, p)) return false;
+  }
+
+  for (usize i = 0; i < keys.size();) {
+    const filter_key& k = keys[i];
+    const usize run = k.rtr ? 1 : aligned_run(keys, i);
+    const u32 mask = ~static_cast<u32>(run - 1);
+
+    bool ok;
+    if (!k.extended) {
+      ok = (run >= 4) ? p.std_mask(std_reg(k.id, false),
+                                   std_reg(mask & MAX_STD_ID, false) | STD_IDE)
+                      : p.std_list(std_reg(k.id, k.rtr));
+    } else {
+      ok = (run >= 4) ? p.ext_mask(ext_reg(k.id, false),
+                                   ext_reg(mask & MAX_EXT_ID, false))
+                      : p.ext_list(ext_reg(k.id, k.rtr));
+    }
+    if (!ok) return false;
+    i += run;
+  }
+  return p.flush();
+}
+
+inline constexpr bool pack_coarse(std::span<const filter_key> keys,
+                                  std::span<const filter_mask> masks, u8 bits,
+                                  filter_packer& p) {
+  const u8 std_bits = bits > 11 ? 11 : bits;
+  const u32 std_mask = (MAX_STD_ID << std_bits) & MAX_STD_ID;
+  const u32 ext_mask = (MAX_EXT_ID << bits) & MAX_EXT_ID;
+
+  // coarsening widens masks too, and ones that end up equal share a slot
+  auto coarse = [&](const filter_mask& m) {
+    const u32 mask = m.mask & (m.extended ? ext_mask : std_mask);
+    return filter_mask{m.id & mask, mask, m.extended};
+  };
+  for (usize i = 0; i < masks.size(); ++i) {
+    const filter_mask c = coarse(masks[i]);
+    bool seen = false;
+    for (usize j = 0; j < i && !seen; ++j) seen = coarse(masks[j]) == c;
+    if (!seen && !pack_mask(c, p)) return false;
+  }
+
+  bool have_prev = false;
+  bool prev_ext = false;
+  u32 prev_group = 0;
+  for (const filter_key& k : keys) {
+    const u32 group = k.id & (k.extended ? ext_mask : std_mask);
+    if (have_prev && prev_ext == k.extended && prev_group == group) continue;
+    have_prev = true;
+    prev_ext = k.extended;
+    prev_group = group;
+
+    const bool ok =
+        k.extended ? p.ext_mask(ext_reg(group, false), ext_reg(ext_mask, false))
+                   : p.std_mask(std_reg(group, false),
+                                std_reg(std_mask, false) | STD_IDE);
+    if (!ok) return false;
+  }
+  return p.flush();
+}
+
+}  // namespace detail
+
+// builds the smallest set of filter banks that accepts every key and every
+// mask block. ids are packed four to a bank in 16-bit list mode, aligned
+// runs of consecutive ids become masks, and when the set doesn't fit in
+// max_banks the low id bits are progressively ignored (coarse_bits) so the
+// hardware passes a superset that software then drops. keys a mask
+// already covers are left out. both spans are sorted and deduplicated in
+// place.
+inline constexpr result<filter_plan> compile_filters(
+    std::span<filter_key> keys, std::span<filter_mask> masks = {},
+    u8 max_banks = FILTER_BANKS_PER_CAN) {
+  if (max_banks == 0 || max_banks > FILTER_BANKS_PER_CAN) {
+    return fail(error_code::invalid_argument, "rtcan: bad filter bank budget");
+  }
+
+  for (const filter_key& k : keys) {
+    if (k.id > (k.extended ? MAX_EXT_ID : MAX_STD_ID)) {
+      return fail(error_code::invalid_argument, "rtcan: id not filterable");
+    }
+  }
+  for (filter_mask& m : masks) {
+    m.mask &= m.extended ? MAX_EXT_ID : MAX_STD_ID;
+    m.id &= m.mask;
+  }
+
+  std::sort(masks.begin(), masks.end(),
+            [](const filter_mask& a, const filter_mask& b) {
+              if (a.extended != b.extended) return !a.extended;
+              if (a.mask != b.mask) return a.mask < b.mask;
+              return a.id < b.id;
+            });
+  const std::span<const filter_mask> unique_masks = masks.first(
+      static_cast<usize>(std::unique(masks.begin(), masks.end()) -
+                         masks.begin()));
+
+  std::sort(keys.begin(), keys.end(),
+            [](const filter_key& a, const filter_key& b) {
+              if (a.extended != b.extended) return !a.extended;
+              if (a.rtr != b.rtr) return !a.rtr;
+              return a.id < b.id;
+            });
+  auto covered = [&](const filter_key& k) {
+    return std::any_of(
+        unique_masks.begin(), unique_masks.end(),
+        [&](const filter_mask& m) { return m.covers(k); });
+  };
+  const auto end = std::remove_if(keys.begin(), keys.end(), covered);
+  const usize n =
+      static_cast<usize>(std::unique(keys.begin(), end) - keys.begin());
+  const std::span<const filter_key> unique_keys = keys.first(n);
+
+  for (u8 bits = 0; bits <= 29; ++bits) {
+    filter_plan plan{};
+    plan.coarse_bits = bits;
+    detail::filter_packer packer{plan, max_banks};
+    const bool fits =
+        (bits == 0)
+            ? detail::pack_exact(unique_keys, unique_masks, packer)
+            : detail::pack_coarse(unique_keys, unique_masks, bits, packer);
+    if (fits) return plan;
+  }
+
+  return fail(error_code::out_of_memory, "rtcan: filter banks exhausted");
+}
+
+inline constexpr filter_plan accept_all_filters() {
+  filter_plan plan{};
+  plan.banks[0] = {.list = false, .wide = true};
+  plan.count = 1;
+  plan.accept_all = true;
+  return plan;
+}
+
+}  // namespace jstm::rtcan
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <jstm/rtcan/rtcan.hpp>
+
+// hal callbacks routed to the service that owns each handle, so can1 and
+// can2 can run side by side without a global per instance. include this
+// from exactly one source file; it defines the can irq handlers and the
+// nine weak HAL_CAN_*Callback symbols.
+
+namespace jstm::rtcan::detail {
+
+inline void can_irq(CAN_TypeDef* instance) {
+  if (service* s = service::from_instance(instance))
+    HAL_CAN_IRQHandler(s->can_handle());
+}
+
+}  // namespace jstm::rtcan::detail
+
+extern "C" {
+
+void CAN1_TX_IRQHandler() { jstm::rtcan::detail::can_irq(CAN1); }
+void CAN1_RX0_IRQHandler() { jstm::rtcan::detail::can_irq(CAN1); }
+void CAN1_RX1_IRQHandler() { jstm::rtcan::detail::can_irq(CAN1); }
+void CAN1_SCE_IRQHandler() { jstm::rtcan::detail::can_irq(CAN1); }
+
+#if defined(CAN2)
+void CAN2_TX_IRQHandler() { jstm::rtcan::detail::can_irq(CAN2); }
+void CAN2_RX0_IRQHandler() { jstm::rtcan::detail::can_irq(CAN2); }
+void CAN2_RX1_IRQHandler() { jstm::rtcan::detail::can_irq(CAN2); }
+void CAN2_SCE_IRQHandler() { jstm::rtcan::detail::can_irq(CAN2); }
+#endif
+
+void HAL_CAN_TxMailbox0CompleteCallback(CAN_HandleTypeDef* h) {
+  if (auto* s = jstm::rtcan::service::from_handle(h))
+    s->handle_tx_complete_isr(0);
+}
+void HAL_CAN_TxMailbox1CompleteCallback(CAN_HandleTypeDef* h) {
+  if (auto* s = jstm::rtcan::service::from_handle(h))
+    s->handle_tx_complete_isr(1);
+}
+void HAL_CAN_TxMailbox2CompleteCallback(CAN_HandleTypeDef* h) {
+  if (auto* s = jstm::rtcan::service::from_handle(h))
+    s->handle_tx_complete_isr(2);
+}
+void HAL_CAN_TxMailbox0AbortCallback(CAN_HandleTypeDef* h) {
+  if (auto* s = jstm::rtcan::service::from_handle(h)) s->handle_tx_abort_isr(0);
+}
+void HAL_CAN_TxMailbox1AbortCallback(CAN_HandleTypeDef* h) {
+  if (auto* s = jstm::rtcan::service::from_handle(h)) s->handle_tx_abort_isr(1);
+}
+void HAL_CAN_TxMailbox2AbortCallback(CAN_HandleTypeDef* h) {
+  if (auto* s = jstm::rtcan::service::from_handle(h)) s->handle_tx_abort_isr(2);
+}
+void HAL_CAN_RxFifo0MsgPendingCallback(CAN_HandleTypeDef* h) {
+  if (auto* s = jstm::rtcan::service::from_handle(h))
+    s->handle_rx_isr(CAN_RX_FIFO0);
+}
+void HAL_CAN_RxFifo1MsgPendingCallback(CAN_HandleTypeDef* h) {
+  if (auto* s = jstm::rtcan::service::from_handle(h))
+    s->handle_rx_isr(CAN_RX_FIFO1);
+}
+void HAL_CAN_ErrorCallback(CAN_HandleTypeDef* h) {
+  if (auto* s = jstm::rtcan::service::from_handle(h)) s->handle_error_isr();
+}
+}
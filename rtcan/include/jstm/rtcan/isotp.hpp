@@ -0,0 +1,141 @@
+#pragma once
+
+#include <jstm/result.hpp>
+#include <jstm/rtcan/rtcan.hpp>
+#include <jstm/rtos/rtos.hpp>
+#include <jstm/types.hpp>
+#include <span>
+
+namespace jstm::rtcan {
+
+// iso 15765-2 transport over a service: normal addressing, classic 8-byte
+// frames. one isotp is one connection. frames arriving on rx_id are
+// reassembled by a callback subscriber in the service's rx thread, which
+// also sends the flow control frames, so there is no task hop between a
+// first frame and its flow control. finished payloads sit in a fixed pool
+// and each one is handed to the delivery queue exactly once.
+//
+//   static rtos::queue<const rtcan::isotp::payload*> uds_q{2};
+//   static rtcan::isotp uds{svc, {.rx_id = 0x7E0, .tx_id = 0x7E8}, uds_q};
+//   uds.start();
+//
+//   const rtcan::isotp::payload* p;
+//   uds_q.receive(p);
+//   handle(p->bytes());
+//   uds.release(p);
+class isotp {
+ public:
+  static constexpr u8 MAX_BUFFERS = 32;
+
+  struct config {
+    // ids as for subscribe(): extended_id() names an extended id of 0x7ff
+    // or below.
+    u32 rx_id = 0x7E0;
+    u32 tx_id = 0x7E8;
+    u8 block_size = 0;  // consecutive frames per flow control, 0 = all
+    u8 st_min = 0;      // raw stmin byte asked of the sender
+    u32 max_payload = 4095;
+    u8 buffers = 2;
+    u8 padding = 0xCC;
+    u32 timeout_ms = 1000;  // n_bs and n_cr
+    u8 max_wait_frames = 8;
+    u32 budget_us = 50;
+  };
+
+  struct payload {
+    u32 id = 0;
+    u32 size = 0;
+    u32 timestamp = 0;  // dwt cycle count of the first frame
+    u8* data = nullptr;
+
+    std::span<const u8> bytes() const { return {data, size}; }
+  };
+
+  struct status {
+    u32 received = 0;       // payloads delivered
+    u32 sent = 0;           // payloads sent by send()
+    u32 flow_controls = 0;  // flow control frames we sent
+    u32 overflows = 0;      // first frames refused: too big or no buffer
+    u32 aborted = 0;        // reassemblies dropped mid-way
+    u32 dropped = 0;        // complete payloads the queue had no room for
+  };
+
+  isotp(service& svc, const config& cfg, rtos::queue<const payload*>& q);
+  ~isotp();
+
+  isotp(const isotp&) = delete;
+  isotp& operator=(const isotp&) = delete;
+
+  result<void> start();
+  void stop();
+
+  // segments data onto tx_id and blocks until every frame is in the
+  // service's tx queue, waiting on the receiver's flow control between
+  // blocks. payloads above 4095 bytes use the 32-bit first frame length.
+  // one sender at a time.
+  result<void> send(std::span<const u8> data,
+                    u32 timeout_ticks = portMAX_DELAY);
+
+  // hands a delivered payload's buffer back to the pool.
+  void release(const payload* p);
+
+  status info() const;
+
+ private:
+  enum class frame_type : u8 {
+    single = 0,
+    first = 1,
+    consecutive = 2,
+    flow_control = 3,
+  };
+
+  enum class flow_status : u8 {
+    clear_to_send = 0,
+    wait = 1,
+    overflow = 2,
+  };
+
+  static void on_frame(const msg& m, void* ctx);
+  void handle_single(const msg& m);
+  void handle_first(const msg& m);
+  void handle_consecutive(const msg& m);
+  void handle_flow_control(const msg& m);
+
+  payload* alloc();
+  void deliver();
+  void abort_rx();
+  void send_flow_control(flow_status s);
+
+  result<void> send_segmented(std::span<const u8> data, u32 start,
+                              u32 timeout_ticks);
+  result<void> wait_flow_control(u32 start, u32 timeout_ticks);
+  result<void> send_frame(const msg& m, u32 start, u32 timeout_ticks);
+  msg frame() const;
+  static u32 st_min_us(u8 raw);
+
+  service& svc_;
+  config cfg_;
+  rtos::queue<const payload*>& q_;
+  payload* pool_ = nullptr;
+  u8* storage_ = nullptr;
+  u32 free_mask_ = 0;
+  bool started_ = false;
+
+  // reassembly state, only touched by the rx thread
+  payload* rx_ = nullptr;
+  u32 rx_expected_ = 0;
+  u8 rx_seq_ = 0;
+  u8 rx_block_ = 0;
+  u32 rx_last_ = 0;
+
+  rtos::mutex tx_lock_;
+  rtos::binary_semaphore fc_ready_;
+  volatile bool awaiting_fc_ = false;
+  u8 fc_status_ = 0;
+  u8 fc_block_size_ = 0;
+  u8 fc_st_min_ = 0;
+
+  status stats_{};
+};
+
+}  // namespace jstm::rtcan
@@ -0,0 +1,199 @@
+#pragma once
+
+#include <jstm/result.hpp>
+#include <jstm/rtcan/rtcan.hpp>
+#include <jstm/rtos/rtos.hpp>
+#include <jstm/types.hpp>
+#include <span>
+
+namespace jstm::rtcan {
+
+// sae j1939 over a service. one mask callback in the rx thread decodes
+// priority, pgn, source and destination once per extended frame and
+// routes on pgn, optionally narrowed to one source address. the
+// transport protocol (bam and rts/cts) reassembles up to 1785 bytes into
+// pooled buffers and delivers through the same routes, and address claim
+// defends our address from the same callback.
+//
+//   static rtcan::j1939 j{svc, {}};
+//   j.subscribe(0xFEF1, on_ccvs);           // any source
+//   j.subscribe(0xF004, 0x00, on_eec1);     // engine #1 only
+//   j.start();
+//   j.claim(0x80, MY_NAME);
+class j1939 {
+ public:
+  static constexpr u8 GLOBAL = 0xFF;  // destination: everyone
+  static constexpr u8 NULL_ADDRESS = 0xFE;
+  static constexpr u8 ANY_SOURCE = 0xFF;
+  static constexpr u16 MAX_PAYLOAD = 1785;
+
+  static constexpr u32 PGN_REQUEST = 0xEA00;
+  static constexpr u32 PGN_ADDRESS_CLAIMED = 0xEE00;
+  static constexpr u32 PGN_TP_CM = 0xEC00;
+  static constexpr u32 PGN_TP_DT = 0xEB00;
+
+  struct config {
+    u16 max_routes = 32;
+    u8 sessions = 4;           // concurrent incoming transport sessions
+    u8 cts_packets = 16;       // packets we grant per cts
+    u32 bam_gap_ms = 50;       // between our bam data packets
+    bool promiscuous = false;  // also route pdu1 frames for other nodes
+    u32 budget_us = 0;
+  };
+
+  struct message {
+    u32 pgn = 0;
+    u8 priority = 0;
+    u8 sa = 0;
+    u8 da = GLOBAL;
+    u16 size = 0;
+    const u8* data = nullptr;
+    u32 timestamp = 0;  // dwt cycle count of the (first) frame
+
+    std::span<const u8> bytes() const { return {data, size}; }
+  };
+
+  // runs in the rx thread with the scheduler suspended, like a callback
+  // subscriber. the message and its data are borrowed for the call.
+  using handler = void (*)(const message& m, void* ctx);
+
+  enum class claim_state : u8 { none, claiming, claimed, lost };
+
+  struct status {
+    u32 routed = 0;       // handler calls
+    u32 transfers = 0;    // transport payloads delivered
+    u32 aborted = 0;      // transport sessions abandoned
+    u32 no_session = 0;   // bam/rts refused: every session busy
+    u32 contentions = 0;  // address claims for our address we saw
+  };
+
+  j1939(service& svc, const config& cfg);
+  ~j1939();
+
+  j1939(const j1939&) = delete;
+  j1939& operator=(const j1939&) = delete;
+
+  result<void> start();
+  void stop();
+
+  result<void> subscribe(u32 pgn, handler fn, void* ctx = nullptr);
+  result<void> subscribe(u32 pgn, u8 sa, handler fn, void* ctx = nullptr);
+  result<void> unsubscribe(u32 pgn, handler fn, void* ctx = nullptr);
+  result<void> unsubscribe(u32 pgn, u8 sa, handler fn, void* ctx = nullptr);
+
+  // claims preferred (or, if name says arbitrary address capable, the
+  // first free address in 128..247 after losing it) and blocks for the
+  // 250 ms contention window. returns the address we ended up with.
+  result<u8> claim(u8 preferred, u64 name);
+
+  u8 address() const { return address_; }
+  claim_state state() const { return claim_; }
+
+  // up to 8 bytes goes out as one frame. longer payloads use bam when
+  // da is GLOBAL and rts/cts otherwise, blocking the caller until the
+  // transfer completes or timeout_ticks pass. one sender at a time, and
+  // only while we hold a claimed address.
+  result<void> send(u32 pgn, std::span<const u8> data, u8 da = GLOBAL,
+                    u8 priority = 6, u32 timeout_ticks = portMAX_DELAY);
+
+  status info() const;
+
+  static u32 frame_id(u32 pgn, u8 priority, u8 sa, u8 da);
+
+ private:
+  static constexpr u8 CM_RTS = 16;
+  static constexpr u8 CM_CTS = 17;
+  static constexpr u8 CM_EOMA = 19;
+  static constexpr u8 CM_BAM = 32;
+  static constexpr u8 CM_ABORT = 255;
+
+  static constexpr u8 ABORT_RESOURCES = 2;
+  static constexpr u8 ABORT_TIMEOUT = 3;
+  static constexpr u8 ABORT_BAD_SEQUENCE = 7;
+
+  struct route {
+    u32 pgn = 0;
+    u8 sa = ANY_SOURCE;
+    handler fn = nullptr;
+    void* ctx = nullptr;
+  };
+
+  struct session {
+    bool active = false;
+    bool bam = false;
+    u8 sa = 0;
+    u8 da = 0;
+    u8 priority = 0;
+    u32 pgn = 0;
+    u16 size = 0;
+    u8 packets = 0;
+    u8 next = 1;        // next sequence number expected
+    u8 window_end = 0;  // last packet granted by our cts
+    u8 limit = 0xFF;    // most packets per cts the sender takes
+    u32 last_tick = 0;
+    u32 timestamp = 0;
+    u8* buf = nullptr;
+  };
+
+  // what the sender is waiting on from the rts/cts peer
+  struct tx_reply {
+    u8 control = 0;
+    u8 count = 0;
+    u8 next = 0;
+  };
+
+  static void on_frame(const msg& m, void* ctx);
+  void route_message(const message& m);
+  void handle_request(const message& m);
+  void handle_address_claimed(const message& m);
+  void handle_tp_cm(const message& m);
+  void handle_tp_dt(const message& m);
+  void send_cts(session& s);
+  void send_cm(u8 da, const u8 (&data)[8], u8 priority = 7);
+  void send_abort(u8 da, u32 pgn, u8 reason);
+  void send_claim();
+  bool pick_address();
+  bool claimed();
+
+  session* find_session(u8 sa, u8 da);
+  session* open_session(u8 sa, u8 da, u32 now);
+  void close_session(session& s, bool aborted);
+
+  result<void> add_route(const route& r);
+  result<void> remove_route(const route& r);
+
+  result<void> send_frame(const msg& m, u32 start, u32 timeout_ticks);
+  result<void> send_bam(u32 pgn, std::span<const u8> data, u8 priority,
+                        u32 start, u32 timeout_ticks);
+  result<void> send_rts(u32 pgn, std::span<const u8> data, u8 da,
+                        u8 priority, u32 start, u32 timeout_ticks);
+  result<void> send_packet(std::span<const u8> data, u8 da, u8 seq,
+                           u32 start, u32 timeout_ticks);
+
+  service& svc_;
+  config cfg_;
+  bool started_ = false;
+
+  route* routes_ = nullptr;
+  u16 num_routes_ = 0;
+
+  session* sessions_ = nullptr;
+  u8* storage_ = nullptr;
+
+  volatile u8 address_ = NULL_ADDRESS;
+  volatile claim_state claim_ = claim_state::none;
+  u64 name_ = 0;
+  volatile u32 claim_tick_ = 0;
+  u8 taken_[32]{};  // addresses claimed by other nodes, one bit each
+
+  rtos::mutex tx_lock_;
+  rtos::binary_semaphore tx_event_;
+  volatile bool tx_waiting_ = false;
+  u32 tx_pgn_ = 0;
+  u8 tx_da_ = GLOBAL;
+  tx_reply tx_reply_{};
+
+  status stats_{};
+};
+
+}  // namespace jstm::rtcan
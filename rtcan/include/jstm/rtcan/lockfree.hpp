@@ -0,0 +1,209 @@
+#pragma once
+
+#include <atomic>
+#include <jstm/types.hpp>
+
+namespace jstm::rtcan {
+
+// single-producer/single-consumer ring of u16 indices. one side may be an
+// isr, the other a task. capacity is rounded up to a power of two.
+class index_ring {
+ public:
+  explicit index_ring(u16 min_capacity) {
+    u32 cap = 1;
+    while (cap < min_capacity) cap <<= 1;
+    mask_ = cap - 1;
+    buf_ = new u16[cap]{};
+    owns_ = true;
+  }
+
+  // uses caller-owned storage. capacity must be a power of two.
+  index_ring(u16* buf, u32 capacity) : buf_{buf}, mask_{capacity - 1} {}
+
+  ~index_ring() {
+    if (owns_) delete[] buf_;
+  }
+
+  index_ring(const index_ring&) = delete;
+  index_ring& operator=(const index_ring&) = delete;
+
+  // returns false when full. was_empty is set when this push made the ring
+  // non-empty, which is the only time the consumer needs waking.
+  bool push(u16 value, bool& was_empty) {
+    const u32 head = head_.load(std::memory_order_relaxed);
+    const u32 tail = tail_.load(std::memory_order_acquire);
+    if (head - tail > mask_) return false;
+    buf_[head & mask_] = value;
+    head_.store(head + 1, std::memory_order_release);
+    was_empty = (head == tail);
+    return true;
+  }
+
+  bool pop(u16& value) {
+    const u32 tail = tail_.load(std::memory_order_relaxed);
+    if (tail == head_.load(std::memory_order_acquire)) return false;
+    value = buf_[tail & mask_];
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  u32 size() const {
+    return head_.load(std::memory_order_acquire) -
+           tail_.load(std::memory_order_acquire);
+  }
+
+  u32 capacity() const { return mask_ + 1; }
+
+ private:
+  u16* buf_ = nullptr;
+  u32 mask_ = 0;
+  bool owns_ = false;
+  std::atomic<u32> head_{0};
+  std::atomic<u32> tail_{0};
+};
+
+// lock-free treiber stack of u16 indices in [0, capacity). push and pop
+// are safe from any mix of tasks and isrs. the head carries a 16-bit tag
+// that changes on every update so a preempted cas can't suffer aba.
+class index_stack {
+ public:
+  static constexpr u16 EMPTY = 0xFFFF;
+
+  explicit index_stack(u16 capacity)
+      : index_stack{new std::atomic<u16>[capacity], capacity} {
+    owns_ = true;
+  }
+
+  // uses caller-owned storage for the per-index links.
+  index_stack(std::atomic<u16>* next, u16 capacity) : next_{next} {
+    for (u16 i = 0; i < capacity; ++i) {
+      next_[i].store(EMPTY, std::memory_order_relaxed);
+    }
+  }
+
+  ~index_stack() {
+    if (owns_) delete[] next_;
+  }
+
+  index_stack(const index_stack&) = delete;
+  index_stack& operator=(const index_stack&) = delete;
+
+  void push(u16 idx) {
+    u32 old_head = head_.load(std::memory_order_relaxed);
+    u32 new_head;
+    do {
+      next_[idx].store(static_cast<u16>(old_head), std::memory_order_relaxed);
+      new_head = next_tag(old_head) | idx;
+    } while (!head_.compare_exchange_weak(old_head, new_head,
+                                          std::memory_order_release,
+                                          std::memory_order_relaxed));
+  }
+
+  u16 pop() {
+    u32 old_head = head_.load(std::memory_order_acquire);
+    while (true) {
+      const u16 idx = static_cast<u16>(old_head);
+      if (idx == EMPTY) return EMPTY;
+      const u16 next = next_[idx].load(std::memory_order_relaxed);
+      if (head_.compare_exchange_weak(old_head, next_tag(old_head) | next,
+                                      std::memory_order_acquire,
+                                      std::memory_order_acquire)) {
+        return idx;
+      }
+    }
+  }
+
+  bool empty() const {
+    return static_cast<u16>(head_.load(std::memory_order_acquire)) == EMPTY;
+  }
+
+ private:
+  static constexpr u32 next_tag(u32 head) {
+    return (head & 0xFFFF'0000u) + 0x0001'0000u;
+  }
+
+  std::atomic<u16>* next_ = nullptr;
+  bool owns_ = false;
+  std::atomic<u32> head_{EMPTY};
+};
+
+// single-producer broadcast ring. the producer never waits: it always
+// writes the next slot, overwriting the oldest entry once the ring has
+// wrapped. each reader keeps its own sequence cursor, and a reader that
+// falls more than capacity behind finds out from the slot sequence
+// instead of reading torn or reordered data.
+template <typename T>
+class broadcast_ring {
+ public:
+  struct slot {
+    std::atomic<u32> seq{0};  // sequence + 1 once written, sequence while
+                              // being written
+    T value{};
+  };
+
+  enum class read_status : u8 { ok, empty, overrun };
+
+  explicit broadcast_ring(u16 min_capacity) {
+    u32 cap = 2;
+    while (cap < min_capacity) cap <<= 1;
+    mask_ = cap - 1;
+    slots_ = new slot[cap]{};
+    owns_ = true;
+  }
+
+  // uses caller-owned storage. capacity must be a power of two, at least 2.
+  broadcast_ring(slot* slots, u32 capacity)
+      : slots_{slots}, mask_{capacity - 1} {}
+
+  ~broadcast_ring() {
+    if (owns_) delete[] slots_;
+  }
+
+  broadcast_ring(const broadcast_ring&) = delete;
+  broadcast_ring& operator=(const broadcast_ring&) = delete;
+
+  // returns the new head, i.e. the published entry's sequence + 1.
+  u32 publish(const T& value) {
+    const u32 seq = head_.load(std::memory_order_relaxed);
+    slot& s = slots_[seq & mask_];
+    s.seq.store(seq, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    s.value = value;
+    s.seq.store(seq + 1, std::memory_order_release);
+    head_.store(seq + 1, std::memory_order_release);
+    return seq + 1;
+  }
+
+  // copies entry seq into out. overrun means it has already been (or is
+  // being) overwritten; the caller should resync to oldest().
+  read_status read(u32 seq, T& out) const {
+    if (static_cast<i32>(head_.load(std::memory_order_acquire) - seq) <= 0)
+      return read_status::empty;
+
+    const slot& s = slots_[seq & mask_];
+    if (s.seq.load(std::memory_order_acquire) != seq + 1)
+      return read_status::overrun;
+    out = s.value;
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (s.seq.load(std::memory_order_relaxed) != seq + 1)
+      return read_status::overrun;
+    return read_status::ok;
+  }
+
+  u32 head() const { return head_.load(std::memory_order_acquire); }
+
+  // oldest sequence that is still intact, leaving one slot of slack for
+  // a write that may be in progress. sequences wrap, so compare cursors
+  // against it with a signed difference.
+  u32 oldest() const { return head_.load(std::memory_order_acquire) - mask_; }
+
+  u32 capacity() const { return mask_ + 1; }
+
+ private:
+  slot* slots_ = nullptr;
+  u32 mask_ = 0;
+  bool owns_ = false;
+  std::atomic<u32> head_{0};
+};
+
+}  // namespace jstm::rtcan
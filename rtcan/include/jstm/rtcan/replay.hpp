@@ -0,0 +1,122 @@
+#pragma once
+
+#include <jstm/result.hpp>
+#include <jstm/rtcan/rtcan.hpp>
+#include <jstm/rtcan/stats.hpp>
+#include <jstm/rtos/rtos.hpp>
+#include <jstm/types.hpp>
+#include <span>
+#include <string_view>
+
+namespace jstm::rtcan {
+
+// plays a recorded trace back onto a service with its original timing.
+// the trace is a capture::dump() image or candump -l text, read in place
+// from flash or ram and decoded one frame ahead. a 32-bit timer counting
+// microseconds fires a compare interrupt at each frame's due time and
+// the isr hands the frame straight to a free tx mailbox, so no task sits
+// between the schedule and the bus.
+//
+//   static const char trace[] = R"((0.000000) can0 123#0102
+//   (0.000250) can0 18FECA00#00FF000000000000
+//   )";
+//
+//   static rtcan::replay player{svc, {.speed_percent = 200}};
+//   extern "C" void TIM2_IRQHandler() { player.handle_timer_isr(); }
+//
+//   player.load_candump(trace);
+//   player.start();
+//   player.wait();
+class replay {
+ public:
+  enum class play_state : u8 { idle, playing, done };
+
+  struct config {
+    TIM_TypeDef* timer = TIM2;  // a 32-bit timer on apb1: TIM2 or TIM5
+    u32 speed_percent = 100;    // 200 plays twice as fast, 50 half speed
+    u32 loops = 1;              // passes over the trace, 0 = until stop()
+    u32 loop_gap_us = 0;        // between the last frame and the next pass
+    u32 retry_us = 5;           // recheck period while every mailbox is busy
+    u32 irq_priority = 6;       // at the can irqs' level, never below 5
+  };
+
+  struct status {
+    u32 sent = 0;      // frames handed to the service
+    u32 failed = 0;    // refused: tx queue full or rate limit hit
+    u32 deferred = 0;  // due with every mailbox busy, retried
+    u32 skipped = 0;   // error records, fd and unparsable candump lines
+    u32 loops = 0;     // passes finished
+    latency_histogram jitter{};  // cycles late, per frame
+    u32 worst_early = 0;         // cycles early, timer vs dwt rounding
+  };
+
+  replay(service& svc, const config& cfg);
+  ~replay();
+
+  replay(const replay&) = delete;
+  replay& operator=(const replay&) = delete;
+
+  // the trace must stay put until playback is done. neither is copied.
+  result<void> load_binary(std::span<const u8> dump);
+  result<void> load_candump(std::string_view text);
+
+  // starts playback from the first frame. if jitter is given, frame i
+  // (counted across loops) writes its jitter there in dwt cycles, late
+  // positive, while i < jitter.size().
+  result<void> start(std::span<i32> jitter = {});
+  void stop();
+
+  // blocks until playback ends or timeout_ticks pass.
+  bool wait(u32 timeout_ticks = portMAX_DELAY);
+
+  play_state state() const { return state_; }
+  status info() const;
+
+  // call from the timer's irq handler.
+  void handle_timer_isr();
+
+ private:
+  enum class format : u8 { none, binary, candump };
+
+  void rewind();
+  bool next_frame(msg& m, u64& time_us);
+  bool next_binary(msg& m, u64& time_us);
+  bool next_candump(msg& m, u64& time_us);
+  bool advance();
+  void finish_isr();
+  void timer_off();
+
+  service& svc_;
+  config cfg_;
+
+  format format_ = format::none;
+  const u8* data_ = nullptr;
+  u32 size_ = 0;
+  u32 pos_ = 0;
+
+  // binary dumps: the header's clocks and the unwrapped timestamp
+  u32 core_hz_ = 0;
+  u32 tick_hz_ = 0;
+  u32 prev_stamp_ = 0;
+  u16 prev_tick_ = 0;
+  u64 cycles_ = 0;
+  bool first_ = true;
+
+  // schedule of the pending frame
+  msg next_{};
+  u64 trace_start_us_ = 0;  // trace time of the pass's first frame
+  u64 pass_start_us_ = 0;   // timer time the pass started at
+  u64 due_us_ = 0;
+  u32 due_cycle_ = 0;
+  u32 start_cycle_ = 0;
+  u32 cycles_per_us_ = 0;
+
+  std::span<i32> jitter_out_{};
+  u32 frame_index_ = 0;
+
+  volatile play_state state_ = play_state::idle;
+  rtos::binary_semaphore done_;
+  status stats_{};
+};
+
+}  // namespace jstm::rtcan
@@ -2,8 +2,12 @@
 
 #include <atomic>
 #include <jstm/result.hpp>
+#include <jstm/rtcan/filters.hpp>
+#include <jstm/rtcan/lockfree.hpp>
+#include <jstm/rtcan/stats.hpp>
 #include <jstm/rtos/rtos.hpp>
 #include <jstm/types.hpp>
+#include <span>
 
 #include "stm32f7xx_hal.h"
 
@@ -16,6 +20,23 @@ enum class bitrate : u32 {
   k1000 = 1'000'000,
 };
 
+enum class batch_mode : u8 {
+  all_or_nothing,  // queue the whole batch or none of it
+  best_effort,     // queue frames in order until the tx queue is full
+};
+
+enum class tx_outcome : u8 {
+  idle,     // not attached to a frame yet
+  pending,
+  sent,     // the controller confirmed the frame went out
+  dropped,  // discarded before it reached the bus
+};
+
+enum class delivery_mode : u8 {
+  queues,  // pooled frames, a pointer per subscriber queue
+  ring,    // one broadcast ring, a cursor per ring_reader
+};
+
 struct config {
   CAN_TypeDef* instance = CAN1;
   bitrate rate = bitrate::k500;
@@ -28,12 +49,20 @@ struct config {
 
   bool loopback = false;
   bool silent = false;
+  bool lockfree_rx = true;
+  bool auto_filters = true;
+  delivery_mode delivery = delivery_mode::queues;
 
   u32 thread_priority = 3;
   u16 tx_queue_depth = 16;
   u16 rx_pool_size = 64;
   u16 hashmap_size = 32;
   u16 max_subscribers = 64;
+  u16 max_patterns = 16;
+  u16 stats_ids = 32;
+  u16 latest_ids = 0;
+  u16 max_rate_limits = 8;
+  u8 callback_strikes = 3;
 };
 
 struct msg {
@@ -42,8 +71,25 @@ struct msg {
   u8 dlc = 0;
   bool extended = false;
   bool rtr = false;
+  u16 seq = 0;
+  u32 timestamp = 0;
 };
 
+inline constexpr u32 id_key(const msg& m) {
+  return m.id | (m.extended ? EXTENDED_FLAG : 0);
+}
+
+// worst-case bits a frame holds the bus for: the frame, the most stuff
+// bits its sof..crc region can need, and the 3-bit interframe space. an
+// 8-byte standard frame is 135 bits, an 8-byte extended one 160.
+inline constexpr u32 frame_bits(const msg& m) {
+  const u32 data = m.rtr ? 0 : 8u * (m.dlc > 8 ? 8 : m.dlc);
+  const u32 stuffed = (m.extended ? 54 : 34) + data;
+  return (m.extended ? 67 : 47) + data + (stuffed - 1) / 4;
+}
+
+inline constexpr u32 MAX_FRAME_BITS = frame_bits({.dlc = 8, .extended = true});
+
 enum class rtcan_error : u32 {
   none = 0x0000'0000,
   init = 0x0000'0001,
@@ -51,9 +97,138 @@ enum class rtcan_error : u32 {
   memory_full = 0x0000'0004,
   tx_timeout = 0x0000'0008,
   hal = 0x0000'0010,
+  callback_overrun = 0x0000'0020,
   internal = 0x8000'0000,
 };
 
+// what the rx thread does when a subscriber's queue is full.
+struct backpressure {
+  enum class policy : u8 {
+    drop_newest,  // keep what's queued, drop the new frame
+    drop_oldest,  // drop the oldest queued frame to make room
+    latest_only,  // the queue only ever holds the newest frame
+    block,        // wait up to ticks for room, then drop the new frame
+  };
+
+  policy p = policy::drop_newest;
+  u32 ticks = 0;
+};
+
+inline constexpr backpressure drop_newest{};
+inline constexpr backpressure drop_oldest{backpressure::policy::drop_oldest};
+inline constexpr backpressure latest_only{backpressure::policy::latest_only};
+
+inline constexpr backpressure block_for(u32 ticks) {
+  return {backpressure::policy::block, ticks};
+}
+
+// per-subscription thinning, checked in the rx thread before a frame is
+// handed over. a frame must pass every check that is enabled.
+struct delivery_filter {
+  bool on_change = false;  // dlc or data differ from the last delivered
+  u16 every = 1;           // one frame in every `every`
+  u32 min_interval = 0;    // ticks since the last delivered frame
+};
+
+class service;
+class capture;
+
+// a subscriber in delivery_mode::ring: a private cursor into the service's
+// broadcast ring. it sees every accepted frame of id's format whose id
+// matches id under mask (every frame of both formats by default), at its
+// own pace. pass extended_id() for an extended id, as with subscribe().
+// falling a whole ring behind skips it to the oldest intact frame and
+// counts the gap; nobody else is held up.
+class ring_reader {
+ public:
+  ring_reader() = default;
+  ring_reader(u32 id, u32 mask);
+
+  ~ring_reader();
+
+  ring_reader(const ring_reader&) = delete;
+  ring_reader& operator=(const ring_reader&) = delete;
+
+  // copies out the next matching frame, or returns false if there is none.
+  bool try_next(msg& out);
+
+  // as try_next, but waits up to timeout_ticks for one. the wait uses the
+  // calling task's notification counter.
+  bool next(msg& out, u32 timeout_ticks = portMAX_DELAY);
+
+  u32 overruns() const { return overruns_; }
+  u32 lost() const { return lost_; }
+  bool attached() const { return svc_ != nullptr; }
+
+ private:
+  friend class service;
+
+  bool matches(const msg& m) const {
+    return ((id_key(m) ^ id_) & mask_) == 0;
+  }
+
+  service* svc_ = nullptr;
+  ring_reader* next_ = nullptr;
+  u32 mask_ = 0;  // key space; only the default reader lacks EXTENDED_FLAG
+  u32 id_ = 0;    // id_key()
+  u32 cursor_ = 0;
+  u32 overruns_ = 0;
+  u32 lost_ = 0;
+  std::atomic<TaskHandle_t> waiter_{nullptr};
+};
+
+// one gateway rule. a frame matches when its format is the rule's and
+// (id & mask) == (rule id & mask); the first matching rule either drops
+// it or forwards it with the id bits in remap_mask replaced by those of
+// remap_id. the forwarded frame keeps its format.
+struct forward_rule {
+  u32 id = 0;
+  u32 mask = 0x1FFF'FFFF;
+  bool extended = false;
+  bool drop = false;
+  u32 remap_mask = 0;
+  u32 remap_id = 0;
+};
+
+// completion handle for one frame. pass it to transmit() and keep it alive
+// until it resolves; the tx complete isr writes to it. a resolved token
+// can be reused for the next frame.
+class tx_token {
+ public:
+  tx_token() = default;
+
+  tx_token(const tx_token&) = delete;
+  tx_token& operator=(const tx_token&) = delete;
+
+  tx_outcome outcome() const {
+    return outcome_.load(std::memory_order_acquire);
+  }
+
+  bool done() const {
+    const tx_outcome o = outcome();
+    return o == tx_outcome::sent || o == tx_outcome::dropped;
+  }
+
+  // dwt cycle count when the controller confirmed the frame, on the same
+  // clock as msg::timestamp. only meaningful once outcome() is sent.
+  u32 timestamp() const { return timestamp_; }
+
+  // waits up to timeout_ticks for the frame to resolve. the wait uses the
+  // calling task's notification counter. false means it is still pending
+  // (e.g. the bus is off and the service has flagged tx_timeout).
+  bool wait(u32 timeout_ticks = portMAX_DELAY);
+
+ private:
+  friend class service;
+
+  void resolve(tx_outcome o, u32 timestamp);
+  void resolve_isr(tx_outcome o, u32 timestamp);
+
+  u32 timestamp_ = 0;
+  std::atomic<tx_outcome> outcome_{tx_outcome::idle};
+  std::atomic<TaskHandle_t> waiter_{nullptr};
+};
+
 inline constexpr rtcan_error operator|(rtcan_error a, rtcan_error b) {
   return static_cast<rtcan_error>(static_cast<u32>(a) | static_cast<u32>(b));
 }
@@ -80,16 +255,93 @@ class service {
 
   result<void> transmit(const msg& m);
 
-  result<void> subscribe(u32 can_id, rtos::queue<const msg*>& q);
+  // as transmit(), and resolves token once the frame has gone out (with
+  // its tx timestamp) or been dropped. fails if token is still pending.
+  result<void> transmit(const msg& m, tx_token& token);
+
+  // as transmit(), but the frame is only worth sending for lifetime_ticks.
+  // after that it's dropped from the queue, or aborted if it's already
+  // sitting in a mailbox, and counted in tx_info().
+  result<void> transmit_within(const msg& m, u32 lifetime_ticks);
+  result<void> transmit_within(const msg& m, u32 lifetime_ticks,
+                               tx_token& token);
+
+  // isr-safe transmit. same fast path as transmit(); a frame that has to
+  // queue wakes the tx thread from the isr.
+  result<void> transmit_from_isr(const msg& m);
+
+  result<void> transmit_latest(const msg& m);
+
+  // queues frames in order under one critical section and wakes the tx
+  // thread at most once. returns how many frames were accepted.
+  result<u16> transmit_batch(std::span<const msg> frames,
+                             batch_mode mode = batch_mode::all_or_nothing);
+
+  // can_id here and in the other per-id calls below picks the frame
+  // format too: 0x123 is the standard id, extended_id(0x123) the extended
+  // one, and anything above 0x7ff is extended.
+  result<void> subscribe(u32 can_id, rtos::queue<const msg*>& q,
+                         backpressure bp = drop_newest,
+                         const delivery_filter& df = {});
 
   result<void> unsubscribe(u32 can_id, rtos::queue<const msg*>& q);
 
-  result<void> subscribe_all(rtos::queue<const msg*>& q);
+  result<void> subscribe_range(u32 lo, u32 hi, rtos::queue<const msg*>& q,
+                               backpressure bp = drop_newest,
+                               const delivery_filter& df = {});
+
+  result<void> unsubscribe_range(u32 lo, u32 hi, rtos::queue<const msg*>& q);
+
+  result<void> subscribe_mask(u32 id, u32 mask, rtos::queue<const msg*>& q,
+                              backpressure bp = drop_newest,
+                              const delivery_filter& df = {});
+
+  result<void> unsubscribe_mask(u32 id, u32 mask, rtos::queue<const msg*>& q);
+
+  using rx_callback = void (*)(const msg& m, void* ctx);
+
+  result<void> subscribe(u32 can_id, rx_callback fn, void* ctx = nullptr,
+                         u32 budget_us = 50);
+
+  result<void> unsubscribe(u32 can_id, rx_callback fn, void* ctx = nullptr);
+
+  // a callback on every id matching a mask, for protocol layers that
+  // decode the id themselves. matches like the queue subscribe_mask().
+  result<void> subscribe_mask(u32 id, u32 mask, rx_callback fn,
+                              void* ctx = nullptr, u32 budget_us = 50);
+
+  result<void> unsubscribe_mask(u32 id, u32 mask, rx_callback fn,
+                                void* ctx = nullptr);
+
+  result<void> subscribe_all(rtos::queue<const msg*>& q,
+                             backpressure bp = drop_newest,
+                             const delivery_filter& df = {});
 
   result<void> unsubscribe_all(rtos::queue<const msg*>& q);
 
+  result<void> subscribe_all(ring_reader& r);
+
+  result<void> unsubscribe_all(ring_reader& r);
+
   u16 subscriber_count(u32 can_id) const;
 
+  result<void> cache_latest(u32 can_id);
+
+  bool latest(u32 can_id, msg& out) const;
+
+  bool latest(u32 can_id, msg& out, u32& age_ticks) const;
+
+  using isr_handler = void (*)(const msg& m, void* ctx);
+
+  // one handler per id and format; pass extended_id() for an extended
+  // frame whose id fits in 11 bits.
+  result<void> register_isr_handler(u32 can_id, isr_handler fn,
+                                    void* ctx = nullptr);
+
+  result<void> unregister_isr_handler(u32 can_id);
+
+  result<void> set_rtr_responses(std::span<const msg> table);
+
   void msg_consumed(const msg* m);
 
   struct filter {
@@ -105,17 +357,165 @@ class service {
 
   void clear_filters();
 
+  struct filter_status {
+    u8 banks = 0;
+    u8 coarse_bits = 0;
+    bool accept_all = false;
+    u32 accepted = 0;
+    u32 unrouted = 0;
+  };
+
+  filter_status filter_info() const;
+
+  static constexpr u8 TX_MAILBOXES = 3;
+  static constexpr u8 TX_PRIORITY_CLASSES = 4;
+
+  struct tx_class_stats {
+    u32 frames = 0;
+    u32 worst_cycles = 0;
+  };
+
+  struct tx_status {
+    u16 queued = 0;
+    u32 preemptions = 0;
+    u32 coalesced = 0;
+    u32 direct = 0;
+    u32 expired = 0;             // stale frames dropped from the queue
+    u32 expired_in_mailbox = 0;  // stale frames aborted in a mailbox
+    u32 rate_limited = 0;
+    tx_class_stats classes[TX_PRIORITY_CLASSES]{};
+  };
+
+  tx_status tx_info() const;
+
+  struct id_stats {
+    u32 id = 0;
+    bool extended = false;
+    u32 rx = 0;
+    u32 tx = 0;
+    u32 pool_drops = 0;
+  };
+
+  struct traffic_status {
+    u32 fifo_overruns[2]{};
+    u32 pool_exhausted = 0;
+    u32 queue_drops = 0;
+    u32 filtered = 0;
+    u32 untracked = 0;
+    u32 ring_skipped = 0;
+    latency_histogram rx_latency{};
+    latency_histogram tx_wait{};
+  };
+
+  traffic_status traffic_info() const;
+
+  u16 id_info(std::span<id_stats> out) const;
+
+  u32 dropped(const rtos::queue<const msg*>& q) const;
+
+  u32 dropped(u32 can_id, const rtos::queue<const msg*>& q) const;
+
+  u32 filtered(const rtos::queue<const msg*>& q) const;
+
+  struct callback_status {
+    u32 can_id = 0;  // id_key(), so extended ids carry EXTENDED_FLAG
+    rx_callback fn = nullptr;
+    void* ctx = nullptr;
+    u32 calls = 0;
+    u32 budget_cycles = 0;
+    u32 worst_cycles = 0;
+    u32 overruns = 0;
+    bool disabled = false;
+  };
+
+  u16 callback_info(std::span<callback_status> out) const;
+
+  // token-bucket cap on the bus time frames with these ids may take,
+  // charged at frame_bits() per frame when they're submitted. a frame
+  // over budget is rejected in the sender's context, so a noisy task
+  // can't fill the tx queue for everyone else. burst_bits must hold at
+  // least one frame (MAX_FRAME_BITS). ids choose the frame format as in
+  // subscribe(), and both ends of a range must be the same format.
+  result<void> limit_rate(u32 can_id, u32 bits_per_sec, u32 burst_bits);
+  result<void> limit_rate_range(u32 lo, u32 hi, u32 bits_per_sec,
+                                u32 burst_bits);
+  result<void> unlimit_rate(u32 can_id);
+  result<void> unlimit_rate_range(u32 lo, u32 hi);
+
+  struct rate_status {
+    u32 lo = 0;  // id_key()
+    u32 hi = 0;
+    u32 bits_per_sec = 0;
+    u32 burst_bits = 0;
+    u32 available_bits = 0;
+    u32 frames = 0;
+    u32 bits = 0;
+    u32 rejected = 0;
+  };
+
+  u16 rate_info(std::span<rate_status> out) const;
+
+  // sum of every limit's bits_per_sec, to check against the bitrate.
+  u32 budgeted_bps() const;
+
+  static constexpr u32 arbitration_key(const msg& m) {
+    if (!m.extended) {
+      return (m.id << 21) | (m.rtr ? 1u << 20 : 0);
+    }
+    return ((m.id >> 18) << 21) | (1u << 20) | (1u << 19) |
+           ((m.id & 0x3FFFF) << 1) | (m.rtr ? 1u : 0);
+  }
+
+  static constexpr u8 priority_class(u32 key) {
+    return static_cast<u8>(key >> 30);
+  }
+
   rtcan_error error() const { return err_; }
 
   void clear_error() { err_ = rtcan_error::none; }
 
   CAN_HandleTypeDef* can_handle() { return &hcan_; }
 
-  void handle_tx_complete_isr();
+  void handle_tx_complete_isr(u32 mailbox);
+  void handle_tx_abort_isr(u32 mailbox);
   void handle_rx_isr(u32 fifo);
   void handle_error_isr();
 
- private:
+  // the live service driving a controller, for routing hal callbacks when
+  // can1 and can2 both run. see jstm/rtcan/hal_callbacks.hpp.
+  static service* from_instance(const CAN_TypeDef* instance);
+  static service* from_handle(const CAN_HandleTypeDef* h) {
+    return h ? from_instance(h->Instance) : nullptr;
+  }
+
+  static constexpr u8 MAX_FORWARD_RULES = 16;
+
+  // gateway mode: every frame this controller accepts is checked against
+  // rules in order and, unless dropped, goes from the rx isr straight into
+  // peer's tx path (no pool slot, task or transmit() call). frames no rule
+  // matches are forwarded only if forward_unmatched is set. local
+  // subscribers still see every frame. the rules are copied.
+  result<void> forward_to(service& peer, std::span<const forward_rule> rules,
+                          bool forward_unmatched = false);
+  result<void> stop_forwarding();
+
+  struct forward_status {
+    u32 forwarded = 0;
+    u32 dropped = 0;  // by a drop rule or because nothing matched
+    u32 failed = 0;   // peer's tx queue full or rate limit hit
+    latency_histogram latency{};  // rx isr -> peer tx complete, cycles
+  };
+
+  forward_status forward_info() const;
+
+  // feeds every frame this controller accepts, and every error interrupt,
+  // to cap from the rx and error isrs. one capture can be attached to
+  // both controllers; each record says which one it came from. it must
+  // outlive the attachment.
+  void attach_capture(capture& cap);
+  void detach_capture();
+
+ protected:
   struct internal_msg {
     msg payload{};
     std::atomic<u16> refcount{0};
@@ -123,29 +523,239 @@ class service {
 
   static constexpr u16 INVALID_INDEX = 0xFFFF;
 
+  // a queue subscriber, or a callback run in the rx thread when fn is set.
   struct subscriber_node {
     rtos::queue<const msg*>* q = nullptr;
-    u16 next = INVALID_INDEX;
+    backpressure bp{};
+    delivery_filter df{};
+    u32 drops = 0;
+    rx_callback fn = nullptr;
+    void* ctx = nullptr;
+    u32 calls = 0;
+    u32 budget_cycles = 0;
+    u32 worst_cycles = 0;
+    u32 overruns = 0;
+    u8 strikes = 0;
+    bool disabled = false;
+    u32 filtered = 0;
+    u16 skip_count = 0;
+    u32 last_tick = 0;
+    u8 last_dlc = 0;
+    u8 last_data[8]{};
+    bool delivered = false;
   };
 
-  struct hashmap_slot {
-    u32 can_id = 0;
-    bool occupied = false;
-    u16 first_subscriber = INVALID_INDEX;
-    u16 chain_next = INVALID_INDEX;
+  // one per subscribed id. its subscribers are fanout_[first, first+count).
+  struct route {
+    u32 can_id = 0;  // id_key()
+    u16 first = 0;
+    u16 count = 0;
   };
 
+  // a range or mask subscription: keys in [lo, hi], or with mask set,
+  // keys where (key & mask) == lo. lo and hi are id_key()s and a mask
+  // includes EXTENDED_FLAG, so a pattern only matches its own format.
+  struct pattern {
+    u32 lo = 0;
+    u32 hi = 0;
+    u32 mask = 0;
+    subscriber_node node{};
+  };
+
+  // a run of ids covered by the same range subscriptions, listed in
+  // segment_subs_[first, first+count).
+  struct segment {
+    u32 lo = 0;
+    u32 hi = 0;
+    u16 first = 0;
+    u16 count = 0;
+  };
+
+  // mask subscriptions sharing one mask, mask_subs_[first, first+count),
+  // sorted by key.
+  struct mask_group {
+    u32 mask = 0;
+    u16 first = 0;
+    u16 count = 0;
+  };
+
+  struct isr_route {
+    u32 can_id = 0;  // id_key()
+    isr_handler fn = nullptr;
+    void* ctx = nullptr;
+  };
+
+  static constexpr u32 EMPTY_STATS_KEY = 0xFFFF'FFFF;
+
+  struct id_counter {
+    u32 key = EMPTY_STATS_KEY;
+    id_stats s{};
+  };
+
+  static constexpr u32 EMPTY_LATEST_KEY = 0xFFFF'FFFF;
+
+  // one cached frame. seq is odd while the isr is writing it.
+  struct latest_entry {
+    u32 key = EMPTY_LATEST_KEY;
+    std::atomic<u32> seq{0};
+    u32 tick = 0;
+    msg m{};
+  };
+
+  // level is in bits * tick rate, so refilling is one multiply per tick
+  // and no fraction of a bit is ever lost.
+  struct rate_limit {
+    u32 lo = 0;  // id_key()
+    u32 hi = 0;
+    u32 bits_per_sec = 0;
+    u32 burst_bits = 0;
+    u64 level = 0;
+    u32 last_tick = 0;
+    u32 frames = 0;
+    u32 bits = 0;
+    u32 rejected = 0;
+  };
+
+  struct tx_entry {
+    msg m{};
+    u32 key = 0;
+    u32 seq = 0;
+    u32 enqueued = 0;
+    bool latest = false;
+    bool expires = false;
+    u32 deadline = 0;  // tick count, only with expires
+    tx_token* token = nullptr;
+    service* origin = nullptr;  // gateway that forwarded the frame
+  };
+
+  struct tx_mailbox {
+    tx_entry e{};
+    bool busy = false;
+    bool aborting = false;
+    bool updated = false;
+  };
+
+  static constexpr u8 MAX_ISR_HANDLERS = 8;
+  static constexpr u8 MAX_RTR_RESPONSES = 8;
+  static constexpr u8 MAX_DEFERRED_SENDS = 4;
+
+  // maps a can id to its index in routes, or -1. replaces the runtime
+  // route index when routes are fixed at build time.
+  using route_lookup = i32 (*)(u32 can_id);
+
+  // everything the service indexes into. the public constructor allocates
+  // these; a derived class can own them instead and pass them to attach().
+  struct buffers {
+    tx_entry* tx_heap = nullptr;
+    internal_msg* rx_pool = nullptr;
+    broadcast_ring<msg>* rx_bcast = nullptr;
+    index_stack* rx_free_stack = nullptr;
+    index_ring* rx_ring = nullptr;
+    u16* rx_seq_std = nullptr;
+    u32* rx_seq_ext_ids = nullptr;
+    u16* rx_seq_ext = nullptr;
+    u32 rx_seq_ext_slots = 0;
+    route* routes = nullptr;
+    u16 num_routes = 0;
+    subscriber_node* fanout = nullptr;
+    u16 fanout_size = 0;
+    pattern* patterns = nullptr;
+    u32* pattern_points = nullptr;
+    segment* segments = nullptr;
+    u16* segment_subs = nullptr;
+    u16* mask_subs = nullptr;
+    mask_group* mask_groups = nullptr;
+    u16* pattern_hits = nullptr;
+    filter_key* filter_keys = nullptr;
+    id_counter* id_counters = nullptr;
+    latest_entry* latest = nullptr;
+    rate_limit* rate_limits = nullptr;
+    route_lookup lookup = nullptr;
+    const filter_plan* filters = nullptr;
+  };
+
+  struct external_buffers_t {};
+
+  // brings up the peripheral only. the caller must attach() before start().
+  service(const config& cfg, external_buffers_t);
+
+  void attach(const buffers& b);
+
+ private:
+  friend class ring_reader;
+
   void init_peripheral();
   void init_gpio();
   void init_pools();
   void configure_filters();
-  void apply_user_filters();
-  u16 alloc_subscriber();
-  void free_subscriber(u16 idx);
-  hashmap_slot* find_or_create_slot(u32 can_id);
-  const hashmap_slot* find_slot(u32 can_id) const;
+  bool masks_fit() const;
+  void refresh_filters();
+  void apply_filter_plan(const filter_plan& plan);
+  const route* find_route(u32 key) const;
+  route* find_or_create_route(u32 key);
+  result<void> add_subscriber(u32 key, const subscriber_node& node);
+  result<void> remove_subscriber(u32 key, const rtos::queue<const msg*>* q,
+                                 rx_callback fn, void* ctx);
+  result<void> add_pattern(const pattern& p);
+  result<void> remove_pattern(u32 lo, u32 hi, u32 mask,
+                              const rtos::queue<const msg*>* q,
+                              rx_callback fn = nullptr, void* ctx = nullptr);
+  static pattern mask_pattern(u32 id, u32 mask);
+  result<void> add_mask_pattern(u32 id, u32 mask,
+                                const subscriber_node& node);
+  result<void> remove_mask_pattern(u32 id, u32 mask,
+                                   const rtos::queue<const msg*>* q,
+                                   rx_callback fn, void* ctx);
+  void rebuild_patterns();
+  u16 match_patterns(u32 key);
+  void run_callback(subscriber_node& s, const msg& m);
+
+  enum class offer_result : u8 { sent, dropped, deferred };
+  offer_result offer(subscriber_node& sub, const msg* m);
+  void count_drop(subscriber_node& sub);
+  static bool wanted(subscriber_node& sub, const msg& m);
+  static void mark_delivered(subscriber_node& sub, const msg& m);
   u32 hash(u32 key) const;
 
+  u16 rx_slot_alloc_isr();
+  void rx_slot_free(u16 slot);
+  void rx_post_isr(u16 slot);
+  bool rx_next(u16& slot, u32 timeout_ticks);
+  void rx_broadcast();
+  u16 next_rx_seq(const msg& m);
+  id_stats* stats_for(const msg& m);
+  latest_entry* latest_for(u32 key) const;
+  void cache_isr(const msg& m);
+  bool dispatch_isr(const msg& m);
+  bool add_to_mailbox(const msg& m, u8& mailbox);
+
+  static bool tx_before(const tx_entry& a, const tx_entry& b);
+  bool tx_push(const tx_entry& e, u16 limit);
+  void tx_pop(tx_entry& e);
+  tx_entry tx_entry_for(const msg& m, bool latest = false);
+  bool tx_enqueue(const tx_entry& e);
+  bool tx_coalesce(const msg& m);
+  bool tx_ready(u32 key) const;
+  bool tx_load(const tx_entry& e);
+  bool tx_direct(const tx_entry& e);
+  static bool tx_expired(const tx_entry& e, u32 now);
+  void tx_drop_expired(const tx_entry& e);
+  bool tx_purge_expired(u32 now);
+  u32 tx_expire_mailboxes(u32 now, u32 limit);
+  result<void> add_rate_limit(u32 lo, u32 hi, u32 bits_per_sec,
+                              u32 burst_bits);
+  result<void> remove_rate_limit(u32 lo, u32 hi);
+  static void rate_refill(rate_limit& r, u32 now);
+  bool rate_admit(const msg& m, u32 now);
+  void rate_refund(const msg& m);
+  result<void> tx_submit(const msg& m, tx_token* token, u32 lifetime_ticks);
+  result<void> tx_submit_tracked(const msg& m, tx_token& token,
+                                 u32 lifetime_ticks);
+  result<void> tx_submit_isr(const msg& m, service* origin);
+  void forward_isr(const msg& m);
+  void tx_pump();
+  void tx_release_isr(u32 mailbox, bool aborted);
+
   static void tx_thread_entry(void* arg);
   static void rx_thread_entry(void* arg);
 
@@ -156,25 +766,92 @@ class service {
   rtos::task* tx_task_ = nullptr;
   rtos::task* rx_task_ = nullptr;
 
-  rtos::queue<msg>* tx_queue_ = nullptr;
-  rtos::counting_semaphore* tx_mailbox_sem_ = nullptr;
+  tx_entry* tx_heap_ = nullptr;
+  u16 tx_heap_size_ = 0;
+  u32 tx_seq_ = 0;
+  tx_mailbox tx_mailboxes_[TX_MAILBOXES]{};
+  tx_status tx_stats_{};
+  u32 tx_stall_since_ = 0;
+  bool tx_stalled_ = false;
 
   internal_msg* rx_pool_ = nullptr;
   rtos::queue<u16>* rx_free_list_ = nullptr;
   rtos::queue<u16>* rx_notify_queue_ = nullptr;
-
-  hashmap_slot* map_ = nullptr;
-  subscriber_node* subscribers_ = nullptr;
-  u16 next_free_subscriber_ = 0;
-  u16 subscriber_free_head_ = INVALID_INDEX;
+  index_stack* rx_free_stack_ = nullptr;
+  index_ring* rx_ring_ = nullptr;
+
+  broadcast_ring<msg>* rx_bcast_ = nullptr;
+  std::atomic<u32> rx_bcast_seen_{0};
+  ring_reader* readers_ = nullptr;
+
+  static constexpr u32 EMPTY_EXT_ID = 0xFFFF'FFFF;
+  u16* rx_seq_std_ = nullptr;
+  u32* rx_seq_ext_ids_ = nullptr;
+  u16* rx_seq_ext_ = nullptr;
+  u32 rx_seq_ext_mask_ = 0;
+
+  route* routes_ = nullptr;
+  u16 num_routes_ = 0;
+  u16* std_routes_ = nullptr;
+  u16* ext_routes_ = nullptr;
+  u32 ext_routes_mask_ = 0;
+  subscriber_node* fanout_ = nullptr;
+  u16 fanout_size_ = 0;
+  // subscribe_all() queues, kept in fanout_ like any other route.
+  static constexpr u32 WILDCARD_ID = 0xFFFF'FFFF;
+  // stands in for the route id of range and mask subscribers.
+  static constexpr u32 PATTERN_ID = 0xFFFF'FFFE;
+  route wildcard_{};
+
+  pattern* patterns_ = nullptr;
+  u16 num_patterns_ = 0;
+  u32* pattern_points_ = nullptr;
+  segment* segments_ = nullptr;
+  u16 num_segments_ = 0;
+  u16* segment_subs_ = nullptr;
+  u16* mask_subs_ = nullptr;
+  mask_group* mask_groups_ = nullptr;
+  u16 num_mask_groups_ = 0;
+  u16* pattern_hits_ = nullptr;
+  route_lookup static_lookup_ = nullptr;
+  const filter_plan* static_filters_ = nullptr;
+  bool owns_buffers_ = false;
 
   static constexpr u8 MAX_USER_FILTERS = 14;
   filter user_filters_[MAX_USER_FILTERS]{};
   u8 num_user_filters_ = 0;
 
-  static constexpr u8 MAX_WILDCARD_SUBS = 4;
-  rtos::queue<const msg*>* wildcard_subs_[MAX_WILDCARD_SUBS]{};
-  u8 num_wildcard_subs_ = 0;
+  id_counter* id_counters_ = nullptr;
+  latest_entry* latest_ = nullptr;
+  rate_limit* rate_limits_ = nullptr;
+  u16 num_rate_limits_ = 0;
+  traffic_status traffic_{};
+
+  filter_key* filter_keys_ = nullptr;
+  // range, mask and reader blocks; two fill every bank, so more than
+  // that can't be filtered and means accept-all.
+  static constexpr u8 MAX_FILTER_MASKS = 2 * FILTER_BANKS_PER_CAN;
+  filter_mask filter_masks_[MAX_FILTER_MASKS]{};
+  filter_plan active_filters_{};
+  u32 rx_accepted_ = 0;
+  u32 rx_unrouted_ = 0;
+
+  isr_route isr_handlers_[MAX_ISR_HANDLERS]{};
+  u8 num_isr_handlers_ = 0;
+
+  msg rtr_responses_[MAX_RTR_RESPONSES]{};
+  u8 num_rtr_responses_ = 0;
+
+  static constexpr u8 MAX_CONTROLLERS = 2;
+  static inline service* instances_[MAX_CONTROLLERS]{};
+
+  service* peer_ = nullptr;
+  forward_rule forward_rules_[MAX_FORWARD_RULES]{};
+  u8 num_forward_rules_ = 0;
+  bool forward_unmatched_ = false;
+  forward_status forward_stats_{};
+
+  capture* capture_ = nullptr;
 
   rtcan_error err_ = rtcan_error::none;
   std::atomic<bool> running_{false};
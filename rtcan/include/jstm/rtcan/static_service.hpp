@@ -0,0 +1,277 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <jstm/rtcan/filters.hpp>
+#include <jstm/rtcan/rtcan.hpp>
+#include <jstm/types.hpp>
+
+namespace jstm::rtcan {
+
+// one fixed route: frames with this id go to every listed queue, in order.
+// ids above 0x7ff are extended, and extended_id(id) names an extended id of
+// 0x7ff or below, as with service::subscribe().
+template <u32 Id, rtos::queue<const msg*>*... Queues>
+struct static_route {
+  static_assert(sizeof...(Queues) > 0, "rtcan: static route has no queues");
+
+  static constexpr u32 id = Id;
+  static constexpr u16 size = sizeof...(Queues);
+  static constexpr rtos::queue<const msg*>* queues[size] = {Queues...};
+};
+
+namespace detail {
+
+inline constexpr u8 MAX_PERFECT_HASH_BITS = 12;
+inline constexpr u32 PERFECT_HASH_ATTEMPTS = 256;
+
+inline constexpr u32 pow2_at_least(u32 n) {
+  u32 p = 1;
+  while (p < n) p <<= 1;
+  return p;
+}
+
+template <usize N>
+constexpr bool unique_ids(const std::array<u32, N>& ids) {
+  for (usize i = 0; i < N; ++i) {
+    for (usize j = i + 1; j < N; ++j) {
+      if (ids[i] == ids[j]) return false;
+    }
+  }
+  return true;
+}
+
+template <usize N>
+constexpr bool filterable_ids(const std::array<u32, N>& ids) {
+  for (u32 key : ids) {
+    if (key_id(key) > MAX_EXT_ID) return false;
+  }
+  return true;
+}
+
+template <usize N>
+constexpr result<filter_plan> static_filter_plan(std::array<u32, N> ids) {
+  std::array<filter_key, N> keys{};
+  for (usize i = 0; i < N; ++i) keys[i] = key_filter(ids[i]);
+  return compile_filters(keys);
+}
+
+// multiply-shift hash with no collisions over a fixed id set:
+// slot = (id * mult) >> (32 - bits).
+struct perfect_hash {
+  u32 mult = 0;
+  u8 bits = 0;
+  bool found = false;
+};
+
+// tries table sizes from the next power of two up to 8x that, and a
+// fixed run of odd multipliers for each. small sets (the usual case for a
+// node) resolve in the first size or two; large ones may not resolve at
+// all, and the caller falls back to binary search.
+template <usize N>
+constexpr perfect_hash find_perfect_hash(const std::array<u32, N>& ids) {
+  u8 min_bits = 1;
+  while ((1u << min_bits) < N) ++min_bits;
+
+  for (u8 bits = min_bits; bits <= min_bits + 3; ++bits) {
+    if (bits > MAX_PERFECT_HASH_BITS) break;
+    for (u32 attempt = 0; attempt < PERFECT_HASH_ATTEMPTS; ++attempt) {
+      const u32 mult = 0x9E37'79B1u + 2u * attempt;
+      bool used[1u << MAX_PERFECT_HASH_BITS]{};
+      bool clash = false;
+      for (u32 id : ids) {
+        const u32 slot = (id * mult) >> (32 - bits);
+        if (used[slot]) {
+          clash = true;
+          break;
+        }
+        used[slot] = true;
+      }
+      if (!clash) return {.mult = mult, .bits = bits, .found = true};
+    }
+  }
+  return {};
+}
+
+}  // namespace detail
+
+// a service whose routes are fixed at build time. all storage lives inside
+// the object (no new[]), the hardware filter banks are compiled by the
+// compiler, and the rx thread resolves ids with a generated perfect hash
+// (or a binary search over a sorted table if none is found). duplicate or
+// out-of-range ids are compile errors.
+//
+//   static rtos::queue<const rtcan::msg*> q_speed{8};
+//   static rtos::queue<const rtcan::msg*> q_log{32};
+//   static rtcan::static_service<
+//       rtcan::static_route<0x100, &q_speed, &q_log>,
+//       rtcan::static_route<0x18FF0021, &q_log>> svc{cfg};
+//
+// rx pool, tx queue and subscribe_all() slot counts come from the
+// template, not from cfg.
+template <u16 RxPool, u16 TxDepth, u16 Wildcards, typename... Routes>
+class basic_static_service : public service {
+ public:
+  static_assert(sizeof...(Routes) > 0, "rtcan: static service has no routes");
+  static_assert(RxPool > 0 && TxDepth > 0, "rtcan: empty rx pool or tx queue");
+
+  static constexpr u16 NUM_ROUTES = sizeof...(Routes);
+  static constexpr u16 NUM_QUEUES = (Routes::size + ...);
+  static constexpr std::array<u32, NUM_ROUTES> IDS = {id_key(Routes::id)...};
+
+  static_assert(detail::unique_ids(IDS), "rtcan: duplicate id in static routes");
+  static_assert(detail::filterable_ids(IDS),
+                "rtcan: static route id is not a valid can id");
+
+  // any set of valid ids compiles. one too big for exact banks comes out
+  // coarsened, as at runtime; FILTERS.coarse_bits says by how much.
+  static constexpr filter_plan FILTERS = *detail::static_filter_plan(IDS);
+
+  explicit basic_static_service(const config& cfg)
+      : service{sized(cfg), external_buffers_t{}},
+        rx_free_stack_storage_{rx_free_next_, RxPool},
+        rx_ring_storage_{rx_ring_buf_, RING_CAPACITY} {
+    u16 r = 0;
+    u16 first = 0;
+    (add_route<Routes>(r, first), ...);
+
+    attach({.tx_heap = tx_heap_storage_,
+            .rx_pool = rx_pool_storage_,
+            .rx_free_stack = &rx_free_stack_storage_,
+            .rx_ring = &rx_ring_storage_,
+            .rx_seq_std = rx_seq_std_storage_,
+            .rx_seq_ext_ids = rx_seq_ext_ids_storage_,
+            .rx_seq_ext = rx_seq_ext_storage_,
+            .rx_seq_ext_slots = SEQ_SLOTS,
+            .routes = routes_storage_,
+            .num_routes = NUM_ROUTES,
+            .fanout = fanout_storage_,
+            .fanout_size = NUM_QUEUES,
+            .filter_keys = filter_keys_storage_,
+            .id_counters = id_counters_storage_,
+            .lookup = &lookup,
+            .filters = &FILTERS});
+  }
+
+  // the rx thread reads the storage below, so stop it before that goes.
+  ~basic_static_service() { stop(); }
+
+  basic_static_service(const basic_static_service&) = delete;
+  basic_static_service& operator=(const basic_static_service&) = delete;
+
+  // routes are part of the type, and there is no table for ranges or
+  // masks. subscribe_all() still works, for up to Wildcards queues.
+  result<void> subscribe(u32, rtos::queue<const msg*>&,
+                         backpressure = drop_newest,
+                         const delivery_filter& = {}) = delete;
+  result<void> unsubscribe(u32, rtos::queue<const msg*>&) = delete;
+  result<void> subscribe_range(u32, u32, rtos::queue<const msg*>&,
+                               backpressure = drop_newest,
+                               const delivery_filter& = {}) = delete;
+  result<void> unsubscribe_range(u32, u32, rtos::queue<const msg*>&) = delete;
+  result<void> subscribe_mask(u32, u32, rtos::queue<const msg*>&,
+                              backpressure = drop_newest,
+                              const delivery_filter& = {}) = delete;
+  result<void> unsubscribe_mask(u32, u32, rtos::queue<const msg*>&) = delete;
+  result<void> subscribe_mask(u32, u32, rx_callback, void* = nullptr,
+                              u32 = 50) = delete;
+  result<void> unsubscribe_mask(u32, u32, rx_callback,
+                                void* = nullptr) = delete;
+
+  static constexpr bool perfect_hashed() { return HASH.found; }
+
+ private:
+  static constexpr u32 RING_CAPACITY = detail::pow2_at_least(RxPool);
+  static constexpr u32 SEQ_SLOTS = detail::pow2_at_least(2u * NUM_ROUTES);
+  static constexpr u16 MAX_FILTER_KEYS =
+      NUM_ROUTES + MAX_ISR_HANDLERS + MAX_RTR_RESPONSES;
+
+  static constexpr detail::perfect_hash HASH = detail::find_perfect_hash(IDS);
+
+  static constexpr auto HASH_TABLE = [] {
+    std::array<u16, (1u << (HASH.found ? HASH.bits : 0))> table{};
+    for (u16& t : table) t = INVALID_INDEX;
+    if (HASH.found) {
+      for (u16 i = 0; i < NUM_ROUTES; ++i) {
+        table[(IDS[i] * HASH.mult) >> (32 - HASH.bits)] = i;
+      }
+    }
+    return table;
+  }();
+
+  struct sorted_id {
+    u32 id = 0;
+    u16 route = 0;
+  };
+
+  static constexpr auto SORTED = [] {
+    std::array<sorted_id, NUM_ROUTES> s{};
+    for (u16 i = 0; i < NUM_ROUTES; ++i) s[i] = {IDS[i], i};
+    std::sort(s.begin(), s.end(), [](const sorted_id& a, const sorted_id& b) {
+      return a.id < b.id;
+    });
+    return s;
+  }();
+
+  static i32 lookup(u32 can_id) {
+    if constexpr (HASH.found) {
+      const u16 r = HASH_TABLE[(can_id * HASH.mult) >> (32 - HASH.bits)];
+      return (r != INVALID_INDEX && IDS[r] == can_id) ? r : -1;
+    } else {
+      u16 lo = 0;
+      u16 hi = NUM_ROUTES;
+      while (lo < hi) {
+        const u16 mid = (lo + hi) / 2;
+        if (SORTED[mid].id < can_id)
+          lo = mid + 1;
+        else
+          hi = mid;
+      }
+      return (lo < NUM_ROUTES && SORTED[lo].id == can_id) ? SORTED[lo].route
+                                                          : -1;
+    }
+  }
+
+  static config sized(config cfg) {
+    cfg.lockfree_rx = true;
+    cfg.delivery = delivery_mode::queues;
+    cfg.rx_pool_size = RxPool;
+    cfg.tx_queue_depth = TxDepth;
+    cfg.hashmap_size = NUM_ROUTES;
+    cfg.max_subscribers = NUM_QUEUES + Wildcards;
+    cfg.max_patterns = 0;
+    cfg.latest_ids = 0;
+    cfg.max_rate_limits = 0;
+    cfg.stats_ids = MAX_FILTER_KEYS;
+    return cfg;
+  }
+
+  template <typename R>
+  void add_route(u16& r, u16& first) {
+    routes_storage_[r++] = {
+        .can_id = id_key(R::id), .first = first, .count = R::size};
+    for (u16 i = 0; i < R::size; ++i) {
+      fanout_storage_[first++] = {.q = R::queues[i], .drops = 0};
+    }
+  }
+
+  tx_entry tx_heap_storage_[TxDepth + TX_MAILBOXES]{};
+  internal_msg rx_pool_storage_[RxPool]{};
+  std::atomic<u16> rx_free_next_[RxPool]{};
+  u16 rx_ring_buf_[RING_CAPACITY]{};
+  index_stack rx_free_stack_storage_;
+  index_ring rx_ring_storage_;
+  u16 rx_seq_std_storage_[MAX_STD_ID + 1]{};
+  u32 rx_seq_ext_ids_storage_[SEQ_SLOTS]{};
+  u16 rx_seq_ext_storage_[SEQ_SLOTS + 1]{};
+  route routes_storage_[NUM_ROUTES]{};
+  subscriber_node fanout_storage_[NUM_QUEUES + Wildcards]{};
+  filter_key filter_keys_storage_[MAX_FILTER_KEYS]{};
+  id_counter id_counters_storage_[MAX_FILTER_KEYS]{};
+};
+
+template <typename... Routes>
+using static_service = basic_static_service<64, 16, 4, Routes...>;
+
+}  // namespace jstm::rtcan
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <bit>
+#include <jstm/types.hpp>
+
+namespace jstm::rtcan {
+
+// log2-bucketed cycle histogram. bucket i counts samples whose bit width
+// is i, i.e. [2^(i-1), 2^i) cycles, so recording is one clz and two
+// increments. the last bucket also takes everything above it.
+struct latency_histogram {
+  static constexpr u8 BUCKETS = 32;
+
+  u32 counts[BUCKETS]{};
+  u32 samples = 0;
+  u32 worst = 0;
+
+  void add(u32 cycles) {
+    const u32 b = static_cast<u32>(std::bit_width(cycles));
+    ++counts[b < BUCKETS ? b : BUCKETS - 1];
+    ++samples;
+    if (cycles > worst) worst = cycles;
+  }
+
+  // upper bound, in cycles, of the bucket holding the pct-th percentile.
+  u32 percentile(u8 pct) const {
+    if (samples == 0) return 0;
+    const u64 target = (static_cast<u64>(samples) * pct + 99) / 100;
+    u64 seen = 0;
+    for (u8 i = 0; i < BUCKETS; ++i) {
+      seen += counts[i];
+      if (seen < target) continue;
+      if (i == 0) return 0;
+      const u32 upper = (i >= BUCKETS - 1) ? worst : (1u << i) - 1;
+      return upper < worst ? upper : worst;
+    }
+    return worst;
+  }
+};
+
+}  // namespace jstm::rtcan
@@ -0,0 +1,164 @@
+#include <algorithm>
+#include <cstring>
+#include <jstm/rtcan/capture.hpp>
+#include <jstm/rtos/rtos.hpp>
+
+namespace jstm::rtcan {
+
+capture_trigger trigger_on_payload(u32 id, std::span<const u8> data,
+                                   std::span<const u8> mask) {
+  capture_trigger t{.k = capture_trigger::kind::payload, .id = id};
+  const usize n = std::min<usize>(std::min(data.size(), mask.size()), 8);
+  for (usize i = 0; i < n; ++i) {
+    t.data[i] = data[i];
+    t.data_mask[i] = mask[i];
+  }
+  return t;
+}
+
+capture::capture(std::span<capture_record> ring)
+    : ring_{ring.data()}, capacity_{static_cast<u32>(ring.size())} {}
+
+result<void> capture::arm(const capture_trigger& t, u32 pre, u32 post) {
+  if (capacity_ == 0 || pre >= capacity_ || post >= capacity_ - pre) {
+    return fail(error_code::invalid_argument,
+                "rtcan: capture window bigger than the ring");
+  }
+
+  rtos::critical_section cs;
+  trigger_ = t;
+  pre_ = pre;
+  post_ = post;
+  head_ = 0;
+  trigger_seq_ = 0;
+  triggered_ = false;
+  remaining_ = 0;
+  state_ = state::armed;
+  return ok();
+}
+
+void capture::trigger() {
+  rtos::critical_section cs;
+  if (state_ != state::armed) return;
+  // the trigger point is the next record, or the end if nothing follows
+  triggered_ = true;
+  trigger_seq_ = head_;
+  remaining_ = post_;
+  state_ = post_ == 0 ? state::done : state::triggered;
+}
+
+void capture::stop() {
+  rtos::critical_section cs;
+  if (state_ == state::armed || state_ == state::triggered)
+    state_ = state::done;
+}
+
+u32 capture::first() const {
+  if (triggered_) return trigger_seq_ > pre_ ? trigger_seq_ - pre_ : 0;
+  return head_ > capacity_ ? head_ - capacity_ : 0;
+}
+
+u32 capture::size() const { return head_ - first(); }
+
+u32 capture::trigger_index() const {
+  if (!triggered_ || trigger_seq_ >= head_) return 0xFFFF'FFFF;
+  return trigger_seq_ - first();
+}
+
+u32 capture::read(std::span<capture_record> out, u32 offset) const {
+  const u32 start = first();
+  const u32 count = head_ - start;
+  if (offset >= count) return 0;
+
+  const u32 n = std::min<u32>(static_cast<u32>(out.size()), count - offset);
+  for (u32 i = 0; i < n; ++i) out[i] = ring_[(start + offset + i) % capacity_];
+  return n;
+}
+
+void capture::dump(writer w, void* ctx) const {
+  capture_header h{};
+  h.count = size();
+  h.trigger = trigger_index();
+  h.core_hz = HAL_RCC_GetHCLKFreq();
+  h.tick_hz = configTICK_RATE_HZ;
+  w(&h, sizeof(h), ctx);
+
+  // at most two contiguous runs: up to the end of the ring, then the wrap
+  u32 index = first() % capacity_;
+  u32 left = h.count;
+  while (left > 0) {
+    const u32 run = std::min(left, capacity_ - index);
+    w(&ring_[index], run * sizeof(capture_record), ctx);
+    left -= run;
+    index = 0;
+  }
+}
+
+bool capture::matches(const msg& m) const {
+  if (((m.id ^ trigger_.id) & trigger_.id_mask) != 0) return false;
+  if (trigger_.k == capture_trigger::kind::id) return true;
+
+  for (u8 i = 0; i < 8; ++i) {
+    if (trigger_.data_mask[i] == 0) continue;
+    if (i >= m.dlc || m.rtr) return false;
+    if ((m.data[i] ^ trigger_.data[i]) & trigger_.data_mask[i]) return false;
+  }
+  return true;
+}
+
+void capture::push_isr(const capture_record& r, bool hit) {
+  const u32 seq = head_;
+  capture_record& slot = ring_[seq % capacity_];
+  slot = r;
+
+  if (state_ == state::armed) {
+    if (hit) {
+      slot.flags |= capture_flags::trigger;
+      triggered_ = true;
+      trigger_seq_ = seq;
+      remaining_ = post_;
+      state_ = post_ == 0 ? state::done : state::triggered;
+    }
+  } else if (--remaining_ == 0) {
+    state_ = state::done;
+  }
+  head_ = seq + 1;
+}
+
+void capture::record_isr(const msg& m, bool can2) {
+  if (state_ != state::armed && state_ != state::triggered) return;
+
+  capture_record r{};
+  r.timestamp = m.timestamp;
+  r.id = m.id;
+  r.tick = static_cast<u16>(rtos::tick_count_from_isr());
+  r.dlc = m.dlc;
+  r.flags = (m.extended ? capture_flags::extended : 0) |
+            (m.rtr ? capture_flags::rtr : 0) |
+            (can2 ? capture_flags::can2 : 0);
+  std::memcpy(r.data, m.data, sizeof(r.data));
+
+  const bool hit = state_ == state::armed &&
+                   (trigger_.k == capture_trigger::kind::id ||
+                    trigger_.k == capture_trigger::kind::payload) &&
+                   matches(m);
+  push_isr(r, hit);
+}
+
+void capture::record_error_isr(u32 error, u32 esr, u32 timestamp,
+                               bool can2) {
+  if (state_ != state::armed && state_ != state::triggered) return;
+
+  capture_record r{};
+  r.timestamp = timestamp;
+  r.id = error;
+  r.tick = static_cast<u16>(rtos::tick_count_from_isr());
+  r.dlc = sizeof(esr);
+  r.flags = capture_flags::error | (can2 ? capture_flags::can2 : 0);
+  std::memcpy(r.data, &esr, sizeof(esr));
+
+  push_isr(r, state_ == state::armed &&
+                  trigger_.k == capture_trigger::kind::error);
+}
+
+}  // namespace jstm::rtcan
@@ -0,0 +1,371 @@
+#include <algorithm>
+#include <bit>
+#include <cstring>
+#include <jstm/rtcan/isotp.hpp>
+#include <jstm/time.hpp>
+
+namespace jstm::rtcan {
+
+static constexpr u32 MAX_SHORT_LENGTH = 0xFFF;
+static constexpr u8 SINGLE_MAX = 7;
+static constexpr u8 FIRST_DATA = 6;
+static constexpr u8 FIRST_ESCAPE_DATA = 2;
+static constexpr u8 CONSECUTIVE_DATA = 7;
+
+// ticks left of timeout_ticks since start. portMAX_DELAY never runs out.
+static u32 remaining(u32 start, u32 timeout_ticks) {
+  if (timeout_ticks == portMAX_DELAY) return portMAX_DELAY;
+  const u32 elapsed = rtos::tick_count() - start;
+  return elapsed >= timeout_ticks ? 0 : timeout_ticks - elapsed;
+}
+
+isotp::isotp(service& svc, const config& cfg, rtos::queue<const payload*>& q)
+    : svc_{svc}, cfg_{cfg}, q_{q} {
+  if (cfg_.buffers == 0 || cfg_.buffers > MAX_BUFFERS) return;
+  if (cfg_.max_payload <= SINGLE_MAX) return;
+
+  pool_ = new payload[cfg_.buffers]{};
+  storage_ = new u8[cfg_.buffers * cfg_.max_payload];
+  for (u8 i = 0; i < cfg_.buffers; ++i) {
+    pool_[i].data = storage_ + i * cfg_.max_payload;
+  }
+  free_mask_ = (cfg_.buffers == 32) ? 0xFFFF'FFFFu : (1u << cfg_.buffers) - 1;
+}
+
+isotp::~isotp() {
+  stop();
+  delete[] storage_;
+  delete[] pool_;
+}
+
+result<void> isotp::start() {
+  if (started_) return ok();
+  if (!pool_) {
+    return fail(error_code::invalid_argument, "rtcan: bad isotp config");
+  }
+
+  auto r = svc_.subscribe(cfg_.rx_id, on_frame, this, cfg_.budget_us);
+  if (!r) return r;
+  started_ = true;
+  return ok();
+}
+
+void isotp::stop() {
+  if (!started_) return;
+  svc_.unsubscribe(cfg_.rx_id, on_frame, this);
+  started_ = false;
+
+  // the rx thread no longer calls in, so the reassembly is ours.
+  if (rx_) {
+    release(rx_);
+    rx_ = nullptr;
+  }
+}
+
+isotp::status isotp::info() const {
+  rtos::critical_section cs;
+  return stats_;
+}
+
+isotp::payload* isotp::alloc() {
+  rtos::critical_section cs;
+  if (free_mask_ == 0) return nullptr;
+  const u32 idx = static_cast<u32>(std::countr_zero(free_mask_));
+  free_mask_ &= ~(1u << idx);
+  return &pool_[idx];
+}
+
+void isotp::release(const payload* p) {
+  if (!p) return;
+  const u32 idx = static_cast<u32>(p - pool_);
+  if (idx >= cfg_.buffers) return;
+  rtos::critical_section cs;
+  free_mask_ |= 1u << idx;
+}
+
+void isotp::on_frame(const msg& m, void* ctx) {
+  if (m.rtr || m.dlc == 0) return;
+
+  auto* self = static_cast<isotp*>(ctx);
+  switch (static_cast<frame_type>(m.data[0] >> 4)) {
+    case frame_type::single:
+      self->handle_single(m);
+      break;
+    case frame_type::first:
+      self->handle_first(m);
+      break;
+    case frame_type::consecutive:
+      self->handle_consecutive(m);
+      break;
+    case frame_type::flow_control:
+      self->handle_flow_control(m);
+      break;
+    default:
+      break;
+  }
+}
+
+void isotp::handle_single(const msg& m) {
+  const u8 len = m.data[0] & 0x0F;
+  if (len == 0 || len > SINGLE_MAX || len >= m.dlc) return;
+
+  // a new message interrupts whatever was being reassembled.
+  if (rx_) abort_rx();
+
+  payload* p = alloc();
+  if (!p) {
+    ++stats_.overflows;
+    return;
+  }
+  p->id = m.id;
+  p->size = len;
+  p->timestamp = m.timestamp;
+  std::memcpy(p->data, &m.data[1], len);
+
+  rx_ = p;
+  deliver();
+}
+
+void isotp::handle_first(const msg& m) {
+  if (m.dlc != 8) return;
+  if (rx_) abort_rx();
+
+  u32 size = (static_cast<u32>(m.data[0] & 0x0F) << 8) | m.data[1];
+  u8 offset = 8 - FIRST_DATA;
+  if (size == 0) {
+    size = (static_cast<u32>(m.data[2]) << 24) |
+           (static_cast<u32>(m.data[3]) << 16) |
+           (static_cast<u32>(m.data[4]) << 8) | m.data[5];
+    offset = 8 - FIRST_ESCAPE_DATA;
+    if (size <= MAX_SHORT_LENGTH) return;
+  } else if (size <= SINGLE_MAX) {
+    return;
+  }
+
+  payload* p = (size <= cfg_.max_payload) ? alloc() : nullptr;
+  if (!p) {
+    ++stats_.overflows;
+    send_flow_control(flow_status::overflow);
+    return;
+  }
+  p->id = m.id;
+  p->timestamp = m.timestamp;
+  p->size = 8 - offset;
+  std::memcpy(p->data, &m.data[offset], p->size);
+
+  rx_ = p;
+  rx_expected_ = size;
+  rx_seq_ = 1;
+  rx_block_ = 0;
+  rx_last_ = rtos::tick_count();
+  send_flow_control(flow_status::clear_to_send);
+}
+
+void isotp::handle_consecutive(const msg& m) {
+  if (!rx_) return;
+
+  const u32 now = rtos::tick_count();
+  if (now - rx_last_ > pdMS_TO_TICKS(cfg_.timeout_ms)) {
+    abort_rx();
+    return;
+  }
+
+  const u32 len = std::min<u32>(CONSECUTIVE_DATA, rx_expected_ - rx_->size);
+  if ((m.data[0] & 0x0F) != rx_seq_ || m.dlc < len + 1) {
+    abort_rx();
+    return;
+  }
+
+  std::memcpy(rx_->data + rx_->size, &m.data[1], len);
+  rx_->size += len;
+  rx_seq_ = (rx_seq_ + 1) & 0x0F;
+  rx_last_ = now;
+
+  if (rx_->size == rx_expected_) {
+    deliver();
+    return;
+  }
+  if (cfg_.block_size != 0 && ++rx_block_ == cfg_.block_size) {
+    rx_block_ = 0;
+    send_flow_control(flow_status::clear_to_send);
+  }
+}
+
+void isotp::handle_flow_control(const msg& m) {
+  if (!awaiting_fc_ || m.dlc < 3) return;
+  fc_status_ = m.data[0] & 0x0F;
+  fc_block_size_ = m.data[1];
+  fc_st_min_ = m.data[2];
+  fc_ready_.give();
+}
+
+// hands rx_ to the queue. a full queue drops the payload rather than
+// blocking the rx thread.
+void isotp::deliver() {
+  payload* p = rx_;
+  rx_ = nullptr;
+  if (q_.send(p, 0)) {
+    ++stats_.received;
+  } else {
+    ++stats_.dropped;
+    release(p);
+  }
+}
+
+void isotp::abort_rx() {
+  release(rx_);
+  rx_ = nullptr;
+  ++stats_.aborted;
+}
+
+void isotp::send_flow_control(flow_status s) {
+  msg m = frame();
+  m.data[0] = static_cast<u8>(0x30 | static_cast<u8>(s));
+  m.data[1] = cfg_.block_size;
+  m.data[2] = cfg_.st_min;
+  if (svc_.transmit(m)) ++stats_.flow_controls;
+}
+
+msg isotp::frame() const {
+  msg m{.id = key_id(cfg_.tx_id),
+        .dlc = 8,
+        .extended = (id_key(cfg_.tx_id) & EXTENDED_FLAG) != 0};
+  std::memset(m.data, cfg_.padding, sizeof(m.data));
+  return m;
+}
+
+u32 isotp::st_min_us(u8 raw) {
+  if (raw <= 0x7F) return raw * 1000u;
+  if (raw >= 0xF1 && raw <= 0xF9) return (raw - 0xF0) * 100u;
+  return 0x7F * 1000u;  // reserved values mean the longest stmin
+}
+
+result<void> isotp::send(std::span<const u8> data, u32 timeout_ticks) {
+  if (!started_) {
+    return fail(error_code::not_initialized, "rtcan: isotp not started");
+  }
+  if (data.empty()) {
+    return fail(error_code::invalid_argument, "rtcan: empty isotp payload");
+  }
+
+  rtos::lock_guard lock{tx_lock_};
+  const u32 start = rtos::tick_count();
+
+  result<void> r;
+  if (data.size() <= SINGLE_MAX) {
+    msg m = frame();
+    m.data[0] = static_cast<u8>(data.size());
+    std::memcpy(&m.data[1], data.data(), data.size());
+    r = send_frame(m, start, timeout_ticks);
+  } else {
+    fc_ready_.take(0);
+    awaiting_fc_ = true;
+    r = send_segmented(data, start, timeout_ticks);
+    awaiting_fc_ = false;
+  }
+
+  if (r) {
+    rtos::critical_section cs;
+    ++stats_.sent;
+  }
+  return r;
+}
+
+result<void> isotp::send_segmented(std::span<const u8> data, u32 start,
+                                   u32 timeout_ticks) {
+  const u32 size = static_cast<u32>(data.size());
+
+  msg m = frame();
+  u32 offset;
+  if (size <= MAX_SHORT_LENGTH) {
+    m.data[0] = static_cast<u8>(0x10 | (size >> 8));
+    m.data[1] = static_cast<u8>(size);
+    std::memcpy(&m.data[8 - FIRST_DATA], data.data(), FIRST_DATA);
+    offset = FIRST_DATA;
+  } else {
+    m.data[0] = 0x10;
+    m.data[1] = 0;
+    m.data[2] = static_cast<u8>(size >> 24);
+    m.data[3] = static_cast<u8>(size >> 16);
+    m.data[4] = static_cast<u8>(size >> 8);
+    m.data[5] = static_cast<u8>(size);
+    std::memcpy(&m.data[8 - FIRST_ESCAPE_DATA], data.data(),
+                FIRST_ESCAPE_DATA);
+    offset = FIRST_ESCAPE_DATA;
+  }
+  if (auto r = send_frame(m, start, timeout_ticks); !r) return r;
+
+  const u32 cycles_per_us = HAL_RCC_GetHCLKFreq() / 1'000'000;
+  const u32 cycles_per_tick = HAL_RCC_GetHCLKFreq() / configTICK_RATE_HZ;
+  u8 seq = 1;
+
+  while (offset < size) {
+    if (auto r = wait_flow_control(start, timeout_ticks); !r) return r;
+
+    const u8 block_size = fc_block_size_;
+    const u32 gap = st_min_us(fc_st_min_) * cycles_per_us;
+    u32 last = 0;
+
+    for (u16 n = 0; offset < size && (block_size == 0 || n < block_size);
+         ++n) {
+      // sleep through whole ticks of stmin, then spin out the rest.
+      if (n > 0 && gap != 0) {
+        const u32 elapsed = cycle_count() - last;
+        if (elapsed < gap && gap - elapsed > cycles_per_tick) {
+          rtos::this_task::delay((gap - elapsed) / cycles_per_tick);
+        }
+        while (cycle_count() - last < gap) {
+        }
+      }
+
+      msg cf = frame();
+      const u32 len = std::min<u32>(CONSECUTIVE_DATA, size - offset);
+      cf.data[0] = static_cast<u8>(0x20 | (seq & 0x0F));
+      std::memcpy(&cf.data[1], data.data() + offset, len);
+      if (auto r = send_frame(cf, start, timeout_ticks); !r) return r;
+
+      last = cycle_count();
+      offset += len;
+      ++seq;
+    }
+  }
+  return ok();
+}
+
+result<void> isotp::wait_flow_control(u32 start, u32 timeout_ticks) {
+  u8 waits = 0;
+  while (true) {
+    const u32 wait = std::min<u32>(pdMS_TO_TICKS(cfg_.timeout_ms),
+                                   remaining(start, timeout_ticks));
+    if (!fc_ready_.take(wait)) {
+      return fail(error_code::timeout, "rtcan: isotp flow control timeout");
+    }
+
+    switch (static_cast<flow_status>(fc_status_)) {
+      case flow_status::clear_to_send:
+        return ok();
+      case flow_status::wait:
+        if (++waits > cfg_.max_wait_frames) {
+          return fail(error_code::timeout, "rtcan: isotp too many waits");
+        }
+        break;
+      case flow_status::overflow:
+        return fail(error_code::out_of_memory, "rtcan: isotp peer overflow");
+      default:
+        return fail(error_code::io_error, "rtcan: isotp bad flow status");
+    }
+  }
+}
+
+// a full tx queue is retried every tick until the send times out.
+result<void> isotp::send_frame(const msg& m, u32 start, u32 timeout_ticks) {
+  while (!svc_.transmit(m)) {
+    if (remaining(start, timeout_ticks) == 0) {
+      return fail(error_code::timeout, "rtcan: isotp tx timeout");
+    }
+    rtos::this_task::delay(1);
+  }
+  return ok();
+}
+
+}  // namespace jstm::rtcan
@@ -0,0 +1,590 @@
+#include <algorithm>
+#include <cstring>
+#include <jstm/rtcan/j1939.hpp>
+
+namespace jstm::rtcan {
+
+static constexpr u8 PACKET_DATA = 7;
+static constexpr u8 PDU2_MIN_PF = 240;
+static constexpr u8 TP_PRIORITY = 7;
+
+// j1939-21 transport timeouts and the address claim window, in ms.
+static constexpr u32 T1_MS = 750;
+static constexpr u32 T2_MS = 1250;
+static constexpr u32 T3_MS = 1250;
+static constexpr u32 T4_MS = 1050;
+static constexpr u32 CLAIM_WINDOW_MS = 250;
+
+static constexpr u8 FIRST_ARBITRARY = 128;
+static constexpr u8 LAST_ARBITRARY = 247;
+
+// ticks left of timeout_ticks since start. portMAX_DELAY never runs out.
+static u32 remaining(u32 start, u32 timeout_ticks) {
+  if (timeout_ticks == portMAX_DELAY) return portMAX_DELAY;
+  const u32 elapsed = rtos::tick_count() - start;
+  return elapsed >= timeout_ticks ? 0 : timeout_ticks - elapsed;
+}
+
+static u32 read_pgn(const u8* d) {
+  return d[0] | (static_cast<u32>(d[1]) << 8) | (static_cast<u32>(d[2]) << 16);
+}
+
+static void write_pgn(u8* d, u32 pgn) {
+  d[0] = static_cast<u8>(pgn);
+  d[1] = static_cast<u8>(pgn >> 8);
+  d[2] = static_cast<u8>(pgn >> 16);
+}
+
+static u8 packets_for(u16 size) {
+  return static_cast<u8>((size + PACKET_DATA - 1) / PACKET_DATA);
+}
+
+j1939::j1939(service& svc, const config& cfg) : svc_{svc}, cfg_{cfg} {
+  routes_ = new route[cfg_.max_routes]{};
+  sessions_ = new session[cfg_.sessions]{};
+  storage_ = new u8[cfg_.sessions * MAX_PAYLOAD];
+  for (u8 i = 0; i < cfg_.sessions; ++i) {
+    sessions_[i].buf = storage_ + i * MAX_PAYLOAD;
+  }
+}
+
+j1939::~j1939() {
+  stop();
+  delete[] storage_;
+  delete[] sessions_;
+  delete[] routes_;
+}
+
+// every extended id goes to one callback. the subscription is extended
+// only, so the hardware filters can stay on.
+result<void> j1939::start() {
+  if (started_) return ok();
+  auto r = svc_.subscribe_mask(extended_id(0), 0, on_frame, this,
+                               cfg_.budget_us);
+  if (!r) return r;
+  started_ = true;
+  return ok();
+}
+
+void j1939::stop() {
+  if (!started_) return;
+  svc_.unsubscribe_mask(extended_id(0), 0, on_frame, this);
+  started_ = false;
+  for (u8 i = 0; i < cfg_.sessions; ++i) sessions_[i].active = false;
+}
+
+j1939::status j1939::info() const {
+  rtos::critical_section cs;
+  return stats_;
+}
+
+u32 j1939::frame_id(u32 pgn, u8 priority, u8 sa, u8 da) {
+  u32 id = (static_cast<u32>(priority & 0x7) << 26) | ((pgn & 0x3FFFF) << 8) |
+           sa;
+  if (((pgn >> 8) & 0xFF) < PDU2_MIN_PF) {
+    id = (id & ~0xFF00u) | (static_cast<u32>(da) << 8);
+  }
+  return id;
+}
+
+result<void> j1939::subscribe(u32 pgn, handler fn, void* ctx) {
+  return add_route({.pgn = pgn, .sa = ANY_SOURCE, .fn = fn, .ctx = ctx});
+}
+
+result<void> j1939::subscribe(u32 pgn, u8 sa, handler fn, void* ctx) {
+  return add_route({.pgn = pgn, .sa = sa, .fn = fn, .ctx = ctx});
+}
+
+result<void> j1939::unsubscribe(u32 pgn, handler fn, void* ctx) {
+  return remove_route({.pgn = pgn, .sa = ANY_SOURCE, .fn = fn, .ctx = ctx});
+}
+
+result<void> j1939::unsubscribe(u32 pgn, u8 sa, handler fn, void* ctx) {
+  return remove_route({.pgn = pgn, .sa = sa, .fn = fn, .ctx = ctx});
+}
+
+// routes stay sorted by pgn so the rx thread finds them with one binary
+// search. the scheduler lock keeps it out while the table moves.
+result<void> j1939::add_route(const route& r) {
+  if (!r.fn) return fail(error_code::invalid_argument, "rtcan: null handler");
+  if (r.pgn > 0x3FFFF)
+    return fail(error_code::invalid_argument, "rtcan: bad pgn");
+
+  rtos::scheduler_lock lock;
+  if (num_routes_ >= cfg_.max_routes) {
+    return fail(error_code::out_of_memory, "rtcan: j1939 route table full");
+  }
+  u16 i = num_routes_;
+  while (i > 0 && routes_[i - 1].pgn > r.pgn) {
+    routes_[i] = routes_[i - 1];
+    --i;
+  }
+  routes_[i] = r;
+  ++num_routes_;
+  return ok();
+}
+
+result<void> j1939::remove_route(const route& r) {
+  rtos::scheduler_lock lock;
+  u16 i = 0;
+  while (i < num_routes_ &&
+         (routes_[i].pgn != r.pgn || routes_[i].sa != r.sa ||
+          routes_[i].fn != r.fn || routes_[i].ctx != r.ctx)) {
+    ++i;
+  }
+  if (i == num_routes_)
+    return fail(error_code::not_found, "rtcan: not subscribed to this pgn");
+
+  for (; i + 1 < num_routes_; ++i) routes_[i] = routes_[i + 1];
+  routes_[--num_routes_] = {};
+  return ok();
+}
+
+void j1939::on_frame(const msg& m, void* ctx) {
+  if (m.rtr) return;
+
+  auto* self = static_cast<j1939*>(ctx);
+  const u8 pf = static_cast<u8>(m.id >> 16);
+  message j{.priority = static_cast<u8>((m.id >> 26) & 0x7),
+            .sa = static_cast<u8>(m.id),
+            .size = m.dlc,
+            .data = m.data,
+            .timestamp = m.timestamp};
+  if (pf < PDU2_MIN_PF) {
+    j.pgn = (m.id >> 8) & 0x3FF00;
+    j.da = static_cast<u8>(m.id >> 8);
+  } else {
+    j.pgn = (m.id >> 8) & 0x3FFFF;
+  }
+
+  const bool for_us = (j.da == GLOBAL || j.da == self->address_);
+  switch (j.pgn) {
+    case PGN_TP_CM:
+      if (for_us) self->handle_tp_cm(j);
+      return;
+    case PGN_TP_DT:
+      if (for_us) self->handle_tp_dt(j);
+      return;
+    case PGN_ADDRESS_CLAIMED:
+      self->handle_address_claimed(j);
+      break;
+    case PGN_REQUEST:
+      if (for_us) self->handle_request(j);
+      break;
+    default:
+      break;
+  }
+
+  if (for_us || self->cfg_.promiscuous) self->route_message(j);
+}
+
+void j1939::route_message(const message& m) {
+  u16 lo = 0;
+  u16 hi = num_routes_;
+  while (lo < hi) {
+    const u16 mid = (lo + hi) / 2;
+    if (routes_[mid].pgn < m.pgn)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  for (u16 i = lo; i < num_routes_ && routes_[i].pgn == m.pgn; ++i) {
+    const route& r = routes_[i];
+    if (r.sa != ANY_SOURCE && r.sa != m.sa) continue;
+    r.fn(m, r.ctx);
+    ++stats_.routed;
+  }
+}
+
+void j1939::handle_request(const message& m) {
+  if (m.size < 3 || read_pgn(m.data) != PGN_ADDRESS_CLAIMED) return;
+  if (claim_ != claim_state::none) send_claim();
+}
+
+// the lower name keeps a contested address. the loser moves to a free
+// arbitrary address if its name allows it, or announces it has none.
+void j1939::handle_address_claimed(const message& m) {
+  if (m.size < 8) return;
+
+  u64 name = 0;
+  for (u8 i = 0; i < 8; ++i) name |= static_cast<u64>(m.data[i]) << (8 * i);
+  if (name == name_) return;
+
+  if (m.sa < NULL_ADDRESS) taken_[m.sa / 8] |= 1u << (m.sa % 8);
+
+  if (claim_ == claim_state::none || claim_ == claim_state::lost) return;
+  if (m.sa != address_) return;
+
+  ++stats_.contentions;
+  if (name_ < name) {
+    send_claim();
+    return;
+  }
+
+  if (pick_address()) {
+    claim_ = claim_state::claiming;
+  } else {
+    address_ = NULL_ADDRESS;
+    claim_ = claim_state::lost;
+  }
+  claim_tick_ = rtos::tick_count();
+  send_claim();
+}
+
+bool j1939::pick_address() {
+  if ((name_ >> 63) == 0) return false;
+  for (u32 a = FIRST_ARBITRARY; a <= LAST_ARBITRARY; ++a) {
+    if (a == address_ || (taken_[a / 8] & (1u << (a % 8)))) continue;
+    address_ = static_cast<u8>(a);
+    return true;
+  }
+  return false;
+}
+
+void j1939::send_claim() {
+  msg m{.id = frame_id(PGN_ADDRESS_CLAIMED, 6, address_, GLOBAL),
+        .dlc = 8,
+        .extended = true};
+  for (u8 i = 0; i < 8; ++i) m.data[i] = static_cast<u8>(name_ >> (8 * i));
+  svc_.transmit(m);
+}
+
+result<u8> j1939::claim(u8 preferred, u64 name) {
+  if (!started_) {
+    return fail(error_code::not_initialized, "rtcan: j1939 not started");
+  }
+  if (preferred >= NULL_ADDRESS) {
+    return fail(error_code::invalid_argument, "rtcan: bad j1939 address");
+  }
+
+  {
+    rtos::scheduler_lock lock;
+    name_ = name;
+    address_ = preferred;
+    claim_ = claim_state::claiming;
+    claim_tick_ = rtos::tick_count();
+  }
+  send_claim();
+
+  // done once a whole window passes without us having to move.
+  const u32 window = pdMS_TO_TICKS(CLAIM_WINDOW_MS);
+  while (true) {
+    u32 wait;
+    {
+      rtos::scheduler_lock lock;
+      if (claim_ == claim_state::lost) break;
+      const u32 since = rtos::tick_count() - claim_tick_;
+      if (since >= window) {
+        claim_ = claim_state::claimed;
+        break;
+      }
+      wait = window - since;
+    }
+    rtos::this_task::delay(wait);
+  }
+
+  if (claim_ == claim_state::lost) {
+    return fail(error_code::connection_failed, "rtcan: j1939 claim lost");
+  }
+  return ok(static_cast<u8>(address_));
+}
+
+// a contention that moves us after claim() returned leaves us claiming;
+// the address is ours again once a whole window passes.
+bool j1939::claimed() {
+  rtos::scheduler_lock lock;
+  if (claim_ == claim_state::claiming &&
+      rtos::tick_count() - claim_tick_ >= pdMS_TO_TICKS(CLAIM_WINDOW_MS)) {
+    claim_ = claim_state::claimed;
+  }
+  return claim_ == claim_state::claimed;
+}
+
+j1939::session* j1939::find_session(u8 sa, u8 da) {
+  for (u8 i = 0; i < cfg_.sessions; ++i) {
+    session& s = sessions_[i];
+    if (s.active && s.sa == sa && s.da == da) return &s;
+  }
+  return nullptr;
+}
+
+// a session idle past t2 is dead and may be reused.
+j1939::session* j1939::open_session(u8 sa, u8 da, u32 now) {
+  session* stale = nullptr;
+  for (u8 i = 0; i < cfg_.sessions; ++i) {
+    session& s = sessions_[i];
+    if (!s.active) return &s;
+    if (!stale && now - s.last_tick > pdMS_TO_TICKS(T2_MS)) stale = &s;
+  }
+  if (stale) close_session(*stale, true);
+  return stale;
+}
+
+void j1939::close_session(session& s, bool aborted) {
+  s.active = false;
+  if (aborted) ++stats_.aborted;
+}
+
+void j1939::handle_tp_cm(const message& m) {
+  if (m.size < 8) return;
+
+  const u8 control = m.data[0];
+  const u32 pgn = read_pgn(&m.data[5]);
+
+  if (control == CM_BAM || control == CM_RTS) {
+    const bool bam = (control == CM_BAM);
+    if (bam != (m.da == GLOBAL)) return;
+
+    const u16 size = m.data[1] | (static_cast<u16>(m.data[2]) << 8);
+    const u8 packets = m.data[3];
+    if (size <= 8 || size > MAX_PAYLOAD || packets != packets_for(size))
+      return;
+
+    // a new announcement from the same sender replaces the old one.
+    if (session* old = find_session(m.sa, m.da)) close_session(*old, true);
+
+    const u32 now = rtos::tick_count();
+    session* s = open_session(m.sa, m.da, now);
+    if (!s) {
+      ++stats_.no_session;
+      if (!bam) send_abort(m.sa, pgn, ABORT_RESOURCES);
+      return;
+    }
+    *s = {.active = true,
+          .bam = bam,
+          .sa = m.sa,
+          .da = m.da,
+          .priority = m.priority,
+          .pgn = pgn,
+          .size = size,
+          .packets = packets,
+          .limit = bam ? u8{0xFF} : m.data[4],
+          .last_tick = now,
+          .timestamp = m.timestamp,
+          .buf = s->buf};
+    if (!bam) send_cts(*s);
+    return;
+  }
+
+  if (control == CM_ABORT) {
+    if (session* s = find_session(m.sa, m.da)) close_session(*s, true);
+  }
+
+  // replies to our own rts/cts transfer
+  if (tx_waiting_ && m.sa == tx_da_ && pgn == tx_pgn_ &&
+      (control == CM_CTS || control == CM_EOMA || control == CM_ABORT)) {
+    tx_reply_ = {.control = control, .count = m.data[1], .next = m.data[2]};
+    tx_event_.give();
+  }
+}
+
+void j1939::handle_tp_dt(const message& m) {
+  session* s = find_session(m.sa, m.da);
+  if (!s || m.size < 1) return;
+
+  const u32 now = rtos::tick_count();
+  const u32 timeout = pdMS_TO_TICKS(s->bam ? T1_MS : T2_MS);
+  if (now - s->last_tick > timeout) {
+    if (!s->bam) send_abort(s->sa, s->pgn, ABORT_TIMEOUT);
+    close_session(*s, true);
+    return;
+  }
+
+  // a peer running past the window it was granted is out of sequence too
+  const u8 seq = m.data[0];
+  if (seq != s->next || (!s->bam && seq > s->window_end)) {
+    if (!s->bam) send_abort(s->sa, s->pgn, ABORT_BAD_SEQUENCE);
+    close_session(*s, true);
+    return;
+  }
+
+  const u32 offset = (seq - 1) * PACKET_DATA;
+  const u32 len = std::min<u32>(PACKET_DATA, s->size - offset);
+  std::memcpy(s->buf + offset, &m.data[1], std::min<u32>(len, m.size - 1));
+  ++s->next;
+  s->last_tick = now;
+
+  if (seq == s->packets) {
+    if (!s->bam) {
+      u8 eoma[8] = {CM_EOMA, static_cast<u8>(s->size),
+                    static_cast<u8>(s->size >> 8), s->packets, 0xFF};
+      write_pgn(&eoma[5], s->pgn);
+      send_cm(s->sa, eoma);
+    }
+    ++stats_.transfers;
+    route_message({.pgn = s->pgn,
+                   .priority = s->priority,
+                   .sa = s->sa,
+                   .da = s->da,
+                   .size = s->size,
+                   .data = s->buf,
+                   .timestamp = s->timestamp});
+    close_session(*s, false);
+    return;
+  }
+
+  if (!s->bam && seq == s->window_end) send_cts(*s);
+}
+
+void j1939::send_cts(session& s) {
+  u32 grant = std::min<u32>(cfg_.cts_packets, s.packets - s.next + 1);
+  grant = std::min<u32>(grant, s.limit);
+  s.window_end = static_cast<u8>(s.next + grant - 1);
+  s.last_tick = rtos::tick_count();
+
+  u8 cts[8] = {CM_CTS, static_cast<u8>(grant), s.next, 0xFF, 0xFF};
+  write_pgn(&cts[5], s.pgn);
+  send_cm(s.sa, cts);
+}
+
+void j1939::send_abort(u8 da, u32 pgn, u8 reason) {
+  u8 abort[8] = {CM_ABORT, reason, 0xFF, 0xFF, 0xFF};
+  write_pgn(&abort[5], pgn);
+  send_cm(da, abort);
+}
+
+void j1939::send_cm(u8 da, const u8 (&data)[8], u8 priority) {
+  msg m{.id = frame_id(PGN_TP_CM, priority, address_, da),
+        .dlc = 8,
+        .extended = true};
+  std::memcpy(m.data, data, 8);
+  svc_.transmit(m);
+}
+
+result<void> j1939::send(u32 pgn, std::span<const u8> data, u8 da,
+                         u8 priority, u32 timeout_ticks) {
+  if (!started_) {
+    return fail(error_code::not_initialized, "rtcan: j1939 not started");
+  }
+  if (!claimed()) {
+    return fail(error_code::not_initialized, "rtcan: j1939 not claimed");
+  }
+  if (data.size() > MAX_PAYLOAD || pgn > 0x3FFFF) {
+    return fail(error_code::invalid_argument, "rtcan: bad j1939 message");
+  }
+
+  rtos::lock_guard lock{tx_lock_};
+  const u32 start = rtos::tick_count();
+
+  if (data.size() <= 8) {
+    msg m{.id = frame_id(pgn, priority, address_, da),
+          .dlc = static_cast<u8>(data.size()),
+          .extended = true};
+    std::memcpy(m.data, data.data(), data.size());
+    return send_frame(m, start, timeout_ticks);
+  }
+  if (da == GLOBAL) return send_bam(pgn, data, priority, start, timeout_ticks);
+
+  tx_pgn_ = pgn;
+  tx_da_ = da;
+  tx_event_.take(0);
+  tx_waiting_ = true;
+  auto r = send_rts(pgn, data, da, priority, start, timeout_ticks);
+  tx_waiting_ = false;
+  return r;
+}
+
+result<void> j1939::send_bam(u32 pgn, std::span<const u8> data, u8 priority,
+                             u32 start, u32 timeout_ticks) {
+  const u16 size = static_cast<u16>(data.size());
+  const u8 packets = packets_for(size);
+
+  msg cm{.id = frame_id(PGN_TP_CM, priority, address_, GLOBAL),
+         .dlc = 8,
+         .extended = true};
+  cm.data[0] = CM_BAM;
+  cm.data[1] = static_cast<u8>(size);
+  cm.data[2] = static_cast<u8>(size >> 8);
+  cm.data[3] = packets;
+  cm.data[4] = 0xFF;
+  write_pgn(&cm.data[5], pgn);
+  if (auto r = send_frame(cm, start, timeout_ticks); !r) return r;
+
+  for (u32 seq = 1; seq <= packets; ++seq) {
+    rtos::this_task::delay_ms(cfg_.bam_gap_ms);
+    if (auto r = send_packet(data, GLOBAL, static_cast<u8>(seq), start,
+                             timeout_ticks);
+        !r)
+      return r;
+  }
+  return ok();
+}
+
+// sends the rts, then whatever each cts asks for, until the receiver
+// acknowledges the end of the message or gives up.
+result<void> j1939::send_rts(u32 pgn, std::span<const u8> data, u8 da,
+                             u8 priority, u32 start, u32 timeout_ticks) {
+  const u16 size = static_cast<u16>(data.size());
+  const u8 packets = packets_for(size);
+
+  msg cm{.id = frame_id(PGN_TP_CM, priority, address_, da),
+         .dlc = 8,
+         .extended = true};
+  cm.data[0] = CM_RTS;
+  cm.data[1] = static_cast<u8>(size);
+  cm.data[2] = static_cast<u8>(size >> 8);
+  cm.data[3] = packets;
+  cm.data[4] = 0xFF;
+  write_pgn(&cm.data[5], pgn);
+  if (auto r = send_frame(cm, start, timeout_ticks); !r) return r;
+
+  u32 wait_ms = T3_MS;
+  while (true) {
+    const u32 wait =
+        std::min<u32>(pdMS_TO_TICKS(wait_ms), remaining(start, timeout_ticks));
+    if (!tx_event_.take(wait)) {
+      send_abort(da, pgn, ABORT_TIMEOUT);
+      return fail(error_code::timeout, "rtcan: j1939 transfer timeout");
+    }
+
+    const tx_reply reply = tx_reply_;
+    if (reply.control == CM_EOMA) return ok();
+    if (reply.control == CM_ABORT) {
+      return fail(error_code::connection_failed, "rtcan: j1939 peer aborted");
+    }
+
+    // a cts for zero packets holds the transfer open.
+    wait_ms = (reply.count == 0) ? T4_MS : T3_MS;
+    for (u32 i = 0; i < reply.count; ++i) {
+      const u32 seq = reply.next + i;
+      if (seq == 0 || seq > packets) break;
+      if (auto r = send_packet(data, da, static_cast<u8>(seq), start,
+                               timeout_ticks);
+          !r)
+        return r;
+    }
+  }
+}
+
+// bam and rts/cts transfers span many frames; stop if the address goes
+// while they run.
+result<void> j1939::send_packet(std::span<const u8> data, u8 da, u8 seq,
+                                u32 start, u32 timeout_ticks) {
+  if (!claimed()) {
+    return fail(error_code::connection_failed, "rtcan: j1939 claim lost");
+  }
+  msg dt{.id = frame_id(PGN_TP_DT, TP_PRIORITY, address_, da),
+         .dlc = 8,
+         .extended = true};
+  std::memset(dt.data, 0xFF, sizeof(dt.data));
+  dt.data[0] = seq;
+
+  const u32 offset = (seq - 1) * PACKET_DATA;
+  const u32 len = std::min<u32>(PACKET_DATA, data.size() - offset);
+  std::memcpy(&dt.data[1], data.data() + offset, len);
+  return send_frame(dt, start, timeout_ticks);
+}
+
+// a full tx queue is retried every tick until the send times out.
+result<void> j1939::send_frame(const msg& m, u32 start, u32 timeout_ticks) {
+  while (!svc_.transmit(m)) {
+    if (remaining(start, timeout_ticks) == 0) {
+      return fail(error_code::timeout, "rtcan: j1939 tx timeout");
+    }
+    rtos::this_task::delay(1);
+  }
+  return ok();
+}
+
+}  // namespace jstm::rtcan
@@ -0,0 +1,371 @@
+#include <algorithm>
+#include <cstring>
+#include <jstm/rtcan/capture.hpp>
+#include <jstm/rtcan/replay.hpp>
+#include <jstm/time.hpp>
+
+namespace jstm::rtcan {
+
+// first frame goes out this long after start(), so the compare is set
+// before the counter gets there.
+static constexpr u32 LEAD_US = 10;
+static constexpr u32 CAN_ERR_FLAG = 0x2000'0000;
+
+// tim2 and tim5 run at twice pclk1 whenever apb1 is divided.
+static u32 apb1_timer_clock() {
+  const u32 pclk1 = HAL_RCC_GetPCLK1Freq();
+  RCC_ClkInitTypeDef clk;
+  u32 latency;
+  HAL_RCC_GetClockConfig(&clk, &latency);
+  return clk.APB1CLKDivider == RCC_HCLK_DIV1 ? pclk1 : pclk1 * 2;
+}
+
+static bool hex_value(char c, u8& v) {
+  if (c >= '0' && c <= '9') {
+    v = static_cast<u8>(c - '0');
+  } else if (c >= 'A' && c <= 'F') {
+    v = static_cast<u8>(c - 'A' + 10);
+  } else if (c >= 'a' && c <= 'f') {
+    v = static_cast<u8>(c - 'a' + 10);
+  } else {
+    return false;
+  }
+  return true;
+}
+
+static void skip_spaces(std::string_view s, usize& i) {
+  while (i < s.size() && (s[i] == ' ' || s[i] == '\t')) ++i;
+}
+
+// one candump -l line: "(1697040000.123456) can0 123#11223344". rtr
+// frames end in #R with an optional dlc. error and fd frames don't parse.
+static bool parse_candump(std::string_view s, msg& m, u64& time_us) {
+  usize i = 0;
+  skip_spaces(s, i);
+  if (i >= s.size() || s[i++] != '(') return false;
+
+  u64 sec = 0;
+  const usize sec_start = i;
+  while (i < s.size() && s[i] >= '0' && s[i] <= '9')
+    sec = sec * 10 + (s[i++] - '0');
+  if (i == sec_start || i >= s.size() || s[i++] != '.') return false;
+
+  u32 usec = 0;
+  u32 digits = 0;
+  while (i < s.size() && s[i] >= '0' && s[i] <= '9') {
+    if (digits++ < 6) usec = usec * 10 + (s[i] - '0');
+    ++i;
+  }
+  for (; digits < 6; ++digits) usec *= 10;
+  if (i >= s.size() || s[i++] != ')') return false;
+
+  skip_spaces(s, i);
+  while (i < s.size() && s[i] != ' ' && s[i] != '\t') ++i;  // interface
+  skip_spaces(s, i);
+
+  u32 id = 0;
+  usize id_digits = 0;
+  u8 v;
+  while (i < s.size() && hex_value(s[i], v)) {
+    id = (id << 4) | v;
+    ++i;
+    if (++id_digits > 8) return false;
+  }
+  if (id_digits == 0 || i >= s.size() || s[i++] != '#') return false;
+  if (i < s.size() && s[i] == '#') return false;  // can fd
+  if (id & CAN_ERR_FLAG || id > MAX_EXT_ID) return false;
+
+  m = {};
+  m.id = id;
+  m.extended = id_digits > 3 || id > MAX_STD_ID;
+
+  if (i < s.size() && (s[i] == 'R' || s[i] == 'r')) {
+    m.rtr = true;
+    ++i;
+    if (i < s.size() && s[i] >= '0' && s[i] <= '8') m.dlc = s[i] - '0';
+  } else {
+    u8 hi, lo;
+    while (i + 1 < s.size() && hex_value(s[i], hi) && hex_value(s[i + 1], lo)) {
+      if (m.dlc == 8) return false;
+      m.data[m.dlc++] = static_cast<u8>((hi << 4) | lo);
+      i += 2;
+    }
+    if (i < s.size() && s[i] != ' ' && s[i] != '\t') return false;
+  }
+
+  time_us = sec * 1'000'000 + usec;
+  return true;
+}
+
+replay::replay(service& svc, const config& cfg) : svc_{svc}, cfg_{cfg} {}
+
+replay::~replay() { stop(); }
+
+result<void> replay::load_binary(std::span<const u8> dump) {
+  if (state_ == play_state::playing) {
+    return fail(error_code::invalid_argument, "rtcan: replay is running");
+  }
+
+  capture_header h;
+  const capture_header expected{};
+  if (dump.size() < sizeof(h)) {
+    return fail(error_code::invalid_argument, "rtcan: not a capture dump");
+  }
+  std::memcpy(&h, dump.data(), sizeof(h));
+  if (h.magic != expected.magic || h.version != expected.version ||
+      h.record_size != sizeof(capture_record) || h.core_hz == 0 ||
+      h.tick_hz == 0) {
+    return fail(error_code::invalid_argument, "rtcan: not a capture dump");
+  }
+  if (h.count > (dump.size() - sizeof(h)) / sizeof(capture_record)) {
+    return fail(error_code::invalid_argument, "rtcan: capture dump truncated");
+  }
+
+  format_ = format::binary;
+  data_ = dump.data() + sizeof(h);
+  size_ = h.count * static_cast<u32>(sizeof(capture_record));
+  core_hz_ = h.core_hz;
+  tick_hz_ = h.tick_hz;
+  rewind();
+  return ok();
+}
+
+result<void> replay::load_candump(std::string_view text) {
+  if (state_ == play_state::playing) {
+    return fail(error_code::invalid_argument, "rtcan: replay is running");
+  }
+  if (text.empty()) {
+    return fail(error_code::invalid_argument, "rtcan: empty trace");
+  }
+
+  format_ = format::candump;
+  data_ = reinterpret_cast<const u8*>(text.data());
+  size_ = static_cast<u32>(text.size());
+  rewind();
+  return ok();
+}
+
+result<void> replay::start(std::span<i32> jitter) {
+  if (format_ == format::none) {
+    return fail(error_code::not_initialized, "rtcan: no trace loaded");
+  }
+  if (state_ == play_state::playing) {
+    return fail(error_code::invalid_argument, "rtcan: replay is running");
+  }
+  if (cfg_.speed_percent == 0) {
+    return fail(error_code::invalid_argument, "rtcan: replay speed is zero");
+  }
+  // the isr transmits through the service, which takes freertos critical
+  // sections, so it can't sit above the syscall threshold
+  if (cfg_.irq_priority < configLIBRARY_MAX_SYSCALL_INTERRUPT_PRIORITY) {
+    return fail(error_code::invalid_argument,
+                "rtcan: replay irq priority above the syscall threshold");
+  }
+
+  IRQn_Type irq;
+  if (cfg_.timer == TIM2) {
+    __HAL_RCC_TIM2_CLK_ENABLE();
+    irq = TIM2_IRQn;
+  } else if (cfg_.timer == TIM5) {
+    __HAL_RCC_TIM5_CLK_ENABLE();
+    irq = TIM5_IRQn;
+  } else {
+    return fail(error_code::invalid_argument,
+                "rtcan: replay needs a 32-bit timer (TIM2 or TIM5)");
+  }
+
+  stats_ = {};
+  jitter_out_ = jitter;
+  frame_index_ = 0;
+  rewind();
+  if (!next_frame(next_, trace_start_us_)) {
+    return fail(error_code::not_found, "rtcan: trace has no frames");
+  }
+  pass_start_us_ = LEAD_US;
+  due_us_ = pass_start_us_;
+  cycles_per_us_ = HAL_RCC_GetHCLKFreq() / 1'000'000;
+
+  // free running microsecond counter, compare channel 1 for the next
+  // frame's due time
+  TIM_TypeDef* t = cfg_.timer;
+  t->CR1 = 0;
+  t->DIER = 0;
+  t->PSC = apb1_timer_clock() / 1'000'000 - 1;
+  t->ARR = 0xFFFF'FFFF;
+  t->CNT = 0;
+  t->EGR = TIM_EGR_UG;
+  t->SR = 0;
+  t->CCR1 = static_cast<u32>(due_us_);
+  t->DIER = TIM_DIER_CC1IE;
+
+  while (done_.take(0)) {
+  }
+
+  HAL_NVIC_SetPriority(irq, cfg_.irq_priority, 0);
+  HAL_NVIC_EnableIRQ(irq);
+
+  {
+    rtos::critical_section cs;
+    state_ = play_state::playing;
+    start_cycle_ = cycle_count();
+    due_cycle_ = start_cycle_ + static_cast<u32>(due_us_ * cycles_per_us_);
+    t->CR1 = TIM_CR1_CEN;
+  }
+  return ok();
+}
+
+void replay::stop() {
+  {
+    rtos::critical_section cs;
+    if (state_ != play_state::playing) return;
+    timer_off();
+    state_ = play_state::done;
+  }
+  done_.give();
+}
+
+bool replay::wait(u32 timeout_ticks) {
+  if (state_ != play_state::playing) return true;
+  return done_.take(timeout_ticks);
+}
+
+replay::status replay::info() const {
+  rtos::critical_section cs;
+  return stats_;
+}
+
+void replay::handle_timer_isr() {
+  TIM_TypeDef* t = cfg_.timer;
+  if ((t->SR & TIM_SR_CC1IF) == 0) return;
+  t->SR = ~TIM_SR_CC1IF;
+
+  while (state_ == play_state::playing) {
+    // not due yet: a compare that matched while an earlier frame, due at
+    // the same time, was already being sent from here.
+    if (static_cast<i32>(static_cast<u32>(due_us_) - t->CNT) > 0) return;
+
+    if (HAL_CAN_GetTxMailboxesFreeLevel(svc_.can_handle()) == 0) {
+      ++stats_.deferred;
+      t->CCR1 = t->CNT + cfg_.retry_us;
+      return;
+    }
+
+    const i32 late = static_cast<i32>(cycle_count() - due_cycle_);
+    if (svc_.transmit_from_isr(next_))
+      ++stats_.sent;
+    else
+      ++stats_.failed;
+
+    if (late >= 0)
+      stats_.jitter.add(static_cast<u32>(late));
+    else
+      stats_.worst_early =
+          std::max(stats_.worst_early, static_cast<u32>(-late));
+    if (frame_index_ < jitter_out_.size()) jitter_out_[frame_index_] = late;
+    ++frame_index_;
+
+    if (!advance()) {
+      finish_isr();
+      return;
+    }
+    t->CCR1 = static_cast<u32>(due_us_);
+  }
+}
+
+bool replay::advance() {
+  u64 time_us;
+  if (!next_frame(next_, time_us)) {
+    ++stats_.loops;
+    if (cfg_.loops != 0 && stats_.loops >= cfg_.loops) return false;
+    rewind();
+    if (!next_frame(next_, time_us)) return false;
+    pass_start_us_ = due_us_ + cfg_.loop_gap_us;
+    trace_start_us_ = time_us;
+  }
+
+  // a frame stamped before the one ahead of it goes out straight after
+  const u64 offset = time_us > trace_start_us_ ? time_us - trace_start_us_ : 0;
+  const u64 due = pass_start_us_ + offset * 100 / cfg_.speed_percent;
+  due_us_ = std::max(due, due_us_);
+  due_cycle_ = start_cycle_ + static_cast<u32>(due_us_ * cycles_per_us_);
+  return true;
+}
+
+void replay::finish_isr() {
+  timer_off();
+  state_ = play_state::done;
+  done_.give_from_isr();
+}
+
+void replay::timer_off() {
+  TIM_TypeDef* t = cfg_.timer;
+  t->DIER = 0;
+  t->CR1 = 0;
+  t->SR = 0;
+}
+
+void replay::rewind() {
+  pos_ = 0;
+  first_ = true;
+  cycles_ = 0;
+}
+
+bool replay::next_frame(msg& m, u64& time_us) {
+  return format_ == format::binary ? next_binary(m, time_us)
+                                   : next_candump(m, time_us);
+}
+
+bool replay::next_binary(msg& m, u64& time_us) {
+  while (pos_ + sizeof(capture_record) <= size_) {
+    capture_record r;
+    std::memcpy(&r, data_ + pos_, sizeof(r));
+    pos_ += sizeof(r);
+
+    if (first_) {
+      first_ = false;
+    } else {
+      // dwt wraps every ~20 s; the tick delta says how many times it did
+      const u32 cycles = r.timestamp - prev_stamp_;
+      const u16 ticks = static_cast<u16>(r.tick - prev_tick_);
+      const u64 expected = static_cast<u64>(ticks) * core_hz_ / tick_hz_;
+      u64 delta = cycles;
+      while (expected > delta + (1ull << 31)) delta += 1ull << 32;
+      cycles_ += delta;
+    }
+    prev_stamp_ = r.timestamp;
+    prev_tick_ = r.tick;
+
+    if (r.flags & capture_flags::error) {
+      ++stats_.skipped;
+      continue;
+    }
+
+    m = {};
+    m.id = r.id;
+    m.extended = (r.flags & capture_flags::extended) != 0;
+    m.rtr = (r.flags & capture_flags::rtr) != 0;
+    m.dlc = std::min<u8>(r.dlc, 8);
+    std::memcpy(m.data, r.data, sizeof(m.data));
+    time_us = cycles_ * 1'000'000 / core_hz_;
+    return true;
+  }
+  return false;
+}
+
+bool replay::next_candump(msg& m, u64& time_us) {
+  const std::string_view text{reinterpret_cast<const char*>(data_), size_};
+  while (pos_ < size_) {
+    usize end = text.find('\n', pos_);
+    if (end == std::string_view::npos) end = size_;
+    std::string_view line = text.substr(pos_, end - pos_);
+    pos_ = static_cast<u32>(end + 1 < size_ ? end + 1 : size_);
+
+    if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+    if (line.find_first_not_of(" \t") == std::string_view::npos) continue;
+    if (parse_candump(line, m, time_us)) return true;
+    ++stats_.skipped;
+  }
+  return false;
+}
+
+}  // namespace jstm::rtcan
@@ -1,6 +1,9 @@
+#include <algorithm>
 #include <cstring>
 #include <jstm/log.hpp>
+#include <jstm/rtcan/capture.hpp>
 #include <jstm/rtcan/rtcan.hpp>
+#include <jstm/time.hpp>
 
 namespace jstm::rtcan {
 
@@ -9,6 +12,13 @@ static constexpr u32 CAN_BS1 = CAN_BS1_13TQ;
 static constexpr u32 CAN_BS2 = CAN_BS2_4TQ;
 static constexpr u32 CAN_SJW = CAN_SJW_1TQ;
 
+// can1 and can2 share one filter block, entered through FMR.FINIT, so
+// every service builds and writes its banks under this one lock.
+static rtos::mutex& filter_lock() {
+  static rtos::mutex m;
+  return m;
+}
+
 static u32 compute_prescaler(bitrate rate) {
   const u32 pclk1 = HAL_RCC_GetPCLK1Freq();
   return pclk1 / (static_cast<u32>(rate) * CAN_TQ);
@@ -18,21 +28,62 @@ service::service(const config& cfg) : cfg_{cfg} {
   init_gpio();
   init_peripheral();
   init_pools();
-  configure_filters();
+}
+
+service::service(const config& cfg, external_buffers_t) : cfg_{cfg} {
+  init_gpio();
+  init_peripheral();
 }
 
 service::~service() {
   stop();
 
+  {
+    rtos::critical_section cs;
+    for (service*& s : instances_) {
+      if (s == this) s = nullptr;
+      if (!s) continue;
+      if (s->peer_ == this) s->peer_ = nullptr;
+      // frames this gateway forwarded may still be queued on the peer.
+      for (u16 i = 0; i < s->tx_heap_size_; ++i) {
+        tx_entry& e = s->tx_heap_[i];
+        if (e.origin == this) e.origin = nullptr;
+      }
+      for (tx_mailbox& box : s->tx_mailboxes_) {
+        if (box.e.origin == this) box.e.origin = nullptr;
+      }
+    }
+  }
+
   delete tx_task_;
   delete rx_task_;
-  delete tx_queue_;
-  delete tx_mailbox_sem_;
-  delete[] rx_pool_;
   delete rx_free_list_;
   delete rx_notify_queue_;
-  delete[] map_;
-  delete[] subscribers_;
+  delete[] std_routes_;
+  delete[] ext_routes_;
+
+  if (!owns_buffers_) return;
+  delete[] tx_heap_;
+  delete[] rx_pool_;
+  delete rx_bcast_;
+  delete rx_free_stack_;
+  delete rx_ring_;
+  delete[] rx_seq_std_;
+  delete[] rx_seq_ext_ids_;
+  delete[] rx_seq_ext_;
+  delete[] routes_;
+  delete[] fanout_;
+  delete[] patterns_;
+  delete[] pattern_points_;
+  delete[] segments_;
+  delete[] segment_subs_;
+  delete[] mask_subs_;
+  delete[] mask_groups_;
+  delete[] pattern_hits_;
+  delete[] filter_keys_;
+  delete[] id_counters_;
+  delete[] latest_;
+  delete[] rate_limits_;
 }
 
 void service::init_gpio() {
@@ -97,44 +148,155 @@ void service::init_peripheral() {
     err_ |= rtcan_error::init;
     log::error("rtcan: HAL_CAN_Init failed");
   }
+
+  const u8 idx = (cfg_.instance == CAN2) ? 1 : 0;
+  instances_[idx] = this;
+}
+
+service* service::from_instance(const CAN_TypeDef* instance) {
+  for (service* s : instances_) {
+    if (s && s->hcan_.Instance == instance) return s;
+  }
+  return nullptr;
 }
 
 void service::init_pools() {
-  tx_queue_ = new rtos::queue<msg>(cfg_.tx_queue_depth);
-  tx_mailbox_sem_ = new rtos::counting_semaphore(3, 3);
+  buffers b{};
+  b.tx_heap = new tx_entry[cfg_.tx_queue_depth + TX_MAILBOXES]{};
+
+  if (cfg_.delivery == delivery_mode::ring) {
+    b.rx_bcast = new broadcast_ring<msg>(cfg_.rx_pool_size);
+  } else if (cfg_.lockfree_rx) {
+    b.rx_pool = new internal_msg[cfg_.rx_pool_size]{};
+    b.rx_free_stack = new index_stack(cfg_.rx_pool_size);
+    b.rx_ring = new index_ring(cfg_.rx_pool_size);
+  } else {
+    b.rx_pool = new internal_msg[cfg_.rx_pool_size]{};
+    rx_free_list_ = new rtos::queue<u16>(cfg_.rx_pool_size);
+    for (u16 i = 0; i < cfg_.rx_pool_size; ++i) {
+      rx_free_list_->send(i, 0);
+    }
+    rx_notify_queue_ = new rtos::queue<u16>(cfg_.rx_pool_size);
+  }
+
+  u32 ext_slots = 1;
+  while (ext_slots < 2u * cfg_.hashmap_size) ext_slots <<= 1;
+
+  b.rx_seq_std = new u16[MAX_STD_ID + 1]{};
+  b.rx_seq_ext_ids = new u32[ext_slots];
+  b.rx_seq_ext = new u16[ext_slots + 1]{};
+  b.rx_seq_ext_slots = ext_slots;
+
+  b.routes = new route[cfg_.hashmap_size]{};
+  b.fanout = new subscriber_node[cfg_.max_subscribers]{};
+
+  // n ranges cut the id space into at most 2n-1 covered segments, each
+  // listing at most n subscribers.
+  const u16 np = cfg_.max_patterns;
+  b.patterns = new pattern[np]{};
+  b.pattern_points = new u32[2 * np]{};
+  b.segments = new segment[2 * np]{};
+  b.segment_subs = new u16[2 * np * np]{};
+  b.mask_subs = new u16[np]{};
+  b.mask_groups = new mask_group[np]{};
+  b.pattern_hits = new u16[np]{};
+  b.filter_keys = new filter_key[cfg_.hashmap_size + cfg_.latest_ids +
+                                 MAX_ISR_HANDLERS + MAX_RTR_RESPONSES]{};
+  b.id_counters = new id_counter[cfg_.stats_ids]{};
+  b.latest = new latest_entry[cfg_.latest_ids]{};
+  b.rate_limits = new rate_limit[cfg_.max_rate_limits]{};
+
+  std_routes_ = new u16[MAX_STD_ID + 1];
+  for (u32 i = 0; i <= MAX_STD_ID; ++i) std_routes_[i] = INVALID_INDEX;
+  ext_routes_mask_ = ext_slots - 1;
+  ext_routes_ = new u16[ext_slots];
+  for (u32 i = 0; i < ext_slots; ++i) ext_routes_[i] = INVALID_INDEX;
+
+  owns_buffers_ = true;
+  attach(b);
+}
 
-  rx_pool_ = new internal_msg[cfg_.rx_pool_size]{};
+void service::attach(const buffers& b) {
+  tx_heap_ = b.tx_heap;
+  rx_pool_ = b.rx_pool;
 
-  rx_free_list_ = new rtos::queue<u16>(cfg_.rx_pool_size);
-  for (u16 i = 0; i < cfg_.rx_pool_size; ++i) {
-    rx_free_list_->send(i, 0);
+  rx_free_stack_ = b.rx_free_stack;
+  if (rx_free_stack_) {
+    for (u16 i = cfg_.rx_pool_size; i > 0; --i) {
+      rx_free_stack_->push(i - 1);
+    }
+  }
+  rx_ring_ = b.rx_ring;
+  rx_bcast_ = b.rx_bcast;
+
+  rx_seq_std_ = b.rx_seq_std;
+  rx_seq_ext_ids_ = b.rx_seq_ext_ids;
+  rx_seq_ext_ = b.rx_seq_ext;
+  rx_seq_ext_mask_ = b.rx_seq_ext_slots - 1;
+  for (u32 i = 0; i < b.rx_seq_ext_slots; ++i) {
+    rx_seq_ext_ids_[i] = EMPTY_EXT_ID;
   }
 
-  rx_notify_queue_ = new rtos::queue<u16>(cfg_.rx_pool_size);
+  routes_ = b.routes;
+  num_routes_ = b.num_routes;
+  fanout_ = b.fanout;
+  fanout_size_ = b.fanout_size;
+  wildcard_ = {.can_id = WILDCARD_ID, .first = fanout_size_, .count = 0};
+  patterns_ = b.patterns;
+  pattern_points_ = b.pattern_points;
+  segments_ = b.segments;
+  segment_subs_ = b.segment_subs;
+  mask_subs_ = b.mask_subs;
+  mask_groups_ = b.mask_groups;
+  pattern_hits_ = b.pattern_hits;
+  filter_keys_ = b.filter_keys;
+  id_counters_ = b.id_counters;
+  latest_ = b.latest;
+  rate_limits_ = b.rate_limits;
+  static_lookup_ = b.lookup;
+  static_filters_ = b.filters;
 
-  map_ = new hashmap_slot[cfg_.hashmap_size]{};
-  subscribers_ = new subscriber_node[cfg_.max_subscribers]{};
-  next_free_subscriber_ = 0;
-  subscriber_free_head_ = INVALID_INDEX;
+  configure_filters();
 }
 
 void service::configure_filters() {
-  CAN_FilterTypeDef filter{};
-  filter.FilterActivation = ENABLE;
-  filter.FilterBank = (cfg_.instance == CAN2) ? 14 : 0;
-  filter.FilterFIFOAssignment = CAN_FILTER_FIFO0;
-  filter.FilterIdHigh = 0x0000;
-  filter.FilterIdLow = 0x0000;
-  filter.FilterMaskIdHigh = 0x0000;
-  filter.FilterMaskIdLow = 0x0000;
-  filter.FilterMode = CAN_FILTERMODE_IDMASK;
-  filter.FilterScale = CAN_FILTERSCALE_32BIT;
-  filter.SlaveStartFilterBank = 14;
-
-  if (HAL_CAN_ConfigFilter(&hcan_, &filter) != HAL_OK) {
-    err_ |= rtcan_error::init;
-    log::error("rtcan: HAL_CAN_ConfigFilter failed");
+  rtos::lock_guard guard{filter_lock()};
+  apply_filter_plan(accept_all_filters());
+}
+
+// caller holds filter_lock().
+void service::apply_filter_plan(const filter_plan& plan) {
+  const u8 bank_offset = (cfg_.instance == CAN2) ? FILTER_BANKS_PER_CAN : 0;
+
+  for (u8 i = 0; i < FILTER_BANKS_PER_CAN; ++i) {
+    const bool was_active = i < active_filters_.count;
+    const bool active = i < plan.count;
+    if (!active && !was_active) continue;
+    if (active && was_active && plan.banks[i] == active_filters_.banks[i])
+      continue;
+
+    const filter_bank& b = plan.banks[i];
+    CAN_FilterTypeDef cf{};
+    cf.FilterActivation = active ? ENABLE : DISABLE;
+    cf.FilterBank = bank_offset + i;
+    cf.FilterFIFOAssignment =
+        (b.fifo == 1) ? CAN_FILTER_FIFO1 : CAN_FILTER_FIFO0;
+    cf.FilterMode = b.list ? CAN_FILTERMODE_IDLIST : CAN_FILTERMODE_IDMASK;
+    cf.FilterScale = b.wide ? CAN_FILTERSCALE_32BIT : CAN_FILTERSCALE_16BIT;
+    cf.FilterIdHigh = b.id_high;
+    cf.FilterIdLow = b.id_low;
+    cf.FilterMaskIdHigh = b.mask_high;
+    cf.FilterMaskIdLow = b.mask_low;
+    cf.SlaveStartFilterBank = FILTER_BANKS_PER_CAN;
+
+    if (HAL_CAN_ConfigFilter(&hcan_, &cf) != HAL_OK) {
+      err_ |= rtcan_error::init;
+      log::error("rtcan: HAL_CAN_ConfigFilter failed for bank %d",
+                 bank_offset + i);
+    }
   }
+
+  active_filters_ = plan;
 }
 
 result<void> service::add_filter(const filter& f) {
@@ -151,39 +313,103 @@ result<void> service::add_filter(u32 std_id, u32 mask) {
 
 void service::clear_filters() { num_user_filters_ = 0; }
 
-void service::apply_user_filters() {
-  const u8 bank_offset = (cfg_.instance == CAN2) ? 14 : 0;
-
-  for (u8 i = 0; i < num_user_filters_; ++i) {
-    const filter& f = user_filters_[i];
+// patterns and ring readers share the filter mask table. a default reader
+// takes every frame of both formats, which only accept-all covers.
+bool service::masks_fit() const {
+  u16 masks = num_patterns_;
+  for (const ring_reader* r = readers_; r; r = r->next_) {
+    if ((r->mask_ & EXTENDED_FLAG) == 0) return false;
+    ++masks;
+  }
+  return masks <= MAX_FILTER_MASKS;
+}
 
-    CAN_FilterTypeDef cf{};
-    cf.FilterActivation = ENABLE;
-    cf.FilterBank = bank_offset + i;
-    cf.FilterFIFOAssignment =
-        (f.fifo == 1) ? CAN_FILTER_FIFO1 : CAN_FILTER_FIFO0;
-    cf.FilterMode = CAN_FILTERMODE_IDMASK;
-    cf.FilterScale = CAN_FILTERSCALE_32BIT;
-    cf.SlaveStartFilterBank = 14;
-
-    if (f.extended) {
-      cf.FilterIdHigh = static_cast<u16>((f.id << 3) >> 16);
-      cf.FilterIdLow = static_cast<u16>((f.id << 3) & 0xFFFF) | (1 << 2);
-      cf.FilterMaskIdHigh = static_cast<u16>((f.mask << 3) >> 16);
-      cf.FilterMaskIdLow = static_cast<u16>((f.mask << 3) & 0xFFFF) | (1 << 2);
+void service::refresh_filters() {
+  rtos::lock_guard guard{filter_lock()};
+
+  // the tables are read with the scheduler held so a concurrent
+  // (un)subscribe can't change them mid-scan. compiling happens after,
+  // since filter_keys_ is only touched under filter_lock().
+  filter_plan fixed{};
+  bool have_fixed = true;
+  u16 n = 0;
+  u8 m = 0;
+  {
+    rtos::scheduler_lock lock;
+    if (num_user_filters_ > 0) {
+      for (u8 i = 0; i < num_user_filters_; ++i) {
+        const filter& f = user_filters_[i];
+        filter_bank& b = fixed.banks[fixed.count++];
+        b.list = false;
+        b.wide = true;
+        b.fifo = f.fifo;
+
+        if (f.extended) {
+          b.id_high = static_cast<u16>((f.id << 3) >> 16);
+          b.id_low = static_cast<u16>((f.id << 3) & 0xFFFF) | (1 << 2);
+          b.mask_high = static_cast<u16>((f.mask << 3) >> 16);
+          b.mask_low = static_cast<u16>((f.mask << 3) & 0xFFFF) | (1 << 2);
+        } else {
+          b.id_high = static_cast<u16>(f.id << 5);
+          b.mask_high = static_cast<u16>(f.mask << 5);
+        }
+      }
+    } else if (!cfg_.auto_filters || wildcard_.count > 0 ||
+               !masks_fit() || peer_ || capture_) {
+      fixed = accept_all_filters();
+    } else if (static_filters_ && !readers_ && num_isr_handlers_ == 0 &&
+               num_rtr_responses_ == 0) {
+      fixed = *static_filters_;
     } else {
-      cf.FilterIdHigh = static_cast<u16>(f.id << 5);
-      cf.FilterIdLow = 0x0000;
-      cf.FilterMaskIdHigh = static_cast<u16>(f.mask << 5);
-      cf.FilterMaskIdLow = 0x0000;
+      have_fixed = false;
+      for (u16 i = 0; i < num_patterns_; ++i) {
+        const pattern& p = patterns_[i];
+        filter_masks_[m++] = p.mask == 0
+                                 ? range_filter(p.lo, p.hi)
+                                 : filter_mask{key_id(p.lo), key_id(p.mask),
+                                               (p.lo & EXTENDED_FLAG) != 0};
+      }
+      for (const ring_reader* r = readers_; r; r = r->next_) {
+        filter_masks_[m++] = {key_id(r->id_), key_id(r->mask_),
+                              (r->id_ & EXTENDED_FLAG) != 0};
+      }
+      for (u16 i = 0; i < num_routes_; ++i) {
+        const route& r = routes_[i];
+        if (r.count > 0) filter_keys_[n++] = key_filter(r.can_id);
+      }
+      for (u8 i = 0; i < num_isr_handlers_; ++i)
+        filter_keys_[n++] = key_filter(isr_handlers_[i].can_id);
+      for (u16 i = 0; i < cfg_.latest_ids; ++i) {
+        const u32 key = latest_[i].key;
+        if (key != EMPTY_LATEST_KEY) filter_keys_[n++] = key_filter(key);
+      }
+      for (u8 i = 0; i < num_rtr_responses_; ++i) {
+        const msg& r = rtr_responses_[i];
+        filter_keys_[n++] = {r.id, r.extended, true};
+      }
     }
+  }
 
-    if (HAL_CAN_ConfigFilter(&hcan_, &cf) != HAL_OK) {
-      err_ |= rtcan_error::init;
-      log::error("rtcan: HAL_CAN_ConfigFilter failed for bank %d",
-                 bank_offset + i);
-    }
+  if (have_fixed) {
+    apply_filter_plan(fixed);
+    return;
   }
+
+  auto plan = compile_filters({filter_keys_, n}, {filter_masks_, m});
+  if (!plan) {
+    log::warn("rtcan: %s, accepting all frames", plan.error().message);
+    apply_filter_plan(accept_all_filters());
+    return;
+  }
+  apply_filter_plan(*plan);
+}
+
+service::filter_status service::filter_info() const {
+  return {.banks = active_filters_.count,
+          .coarse_bits = active_filters_.coarse_bits,
+          .accept_all = active_filters_.accept_all,
+          .accepted = rx_accepted_,
+          .unrouted = rx_unrouted_};
 }
 
 result<void> service::start() {
@@ -191,9 +417,7 @@ result<void> service::start() {
     return fail(error_code::not_initialized, "rtcan: init errors present");
   }
 
-  if (num_user_filters_ > 0) {
-    apply_user_filters();
-  }
+  refresh_filters();
 
   IRQn_Type tx_irq, rx0_irq, rx1_irq, sce_irq;
   if (cfg_.instance == CAN1) {
@@ -219,9 +443,9 @@ result<void> service::start() {
   HAL_NVIC_EnableIRQ(sce_irq);
 
   const u32 notifs = CAN_IT_TX_MAILBOX_EMPTY | CAN_IT_RX_FIFO0_MSG_PENDING |
-                     CAN_IT_RX_FIFO1_MSG_PENDING | CAN_IT_ERROR |
-                     CAN_IT_BUSOFF | CAN_IT_ERROR_PASSIVE |
-                     CAN_IT_ERROR_WARNING;
+                     CAN_IT_RX_FIFO1_MSG_PENDING | CAN_IT_RX_FIFO0_OVERRUN |
+                     CAN_IT_RX_FIFO1_OVERRUN | CAN_IT_ERROR | CAN_IT_BUSOFF |
+                     CAN_IT_ERROR_PASSIVE | CAN_IT_ERROR_WARNING;
 
   if (HAL_CAN_ActivateNotification(&hcan_, notifs) != HAL_OK) {
     return fail(error_code::hardware_fault,
@@ -250,7 +474,8 @@ result<void> service::stop() {
   HAL_CAN_Stop(&hcan_);
   HAL_CAN_DeactivateNotification(
       &hcan_, CAN_IT_TX_MAILBOX_EMPTY | CAN_IT_RX_FIFO0_MSG_PENDING |
-                  CAN_IT_RX_FIFO1_MSG_PENDING | CAN_IT_ERROR | CAN_IT_BUSOFF |
+                  CAN_IT_RX_FIFO1_MSG_PENDING | CAN_IT_RX_FIFO0_OVERRUN |
+                  CAN_IT_RX_FIFO1_OVERRUN | CAN_IT_ERROR | CAN_IT_BUSOFF |
                   CAN_IT_ERROR_PASSIVE | CAN_IT_ERROR_WARNING);
 
   delete tx_task_;
@@ -262,356 +487,1896 @@ result<void> service::stop() {
 }
 
 result<void> service::transmit(const msg& m) {
-  if (!tx_queue_->send(m, 0)) {
-    err_ |= rtcan_error::memory_full;
-    return fail(error_code::out_of_memory, "rtcan: tx queue full");
-  }
-  return ok();
+  return tx_submit(m, nullptr, 0);
 }
 
-u32 service::hash(u32 key) const {
-  u32 h = key;
-  h += (h << 12);
-  h ^= (h >> 22);
-  h += (h << 4);
-  h ^= (h >> 9);
-  h += (h << 10);
-  h ^= (h >> 2);
-  h += (h << 7);
-  h ^= (h >> 12);
-  return h;
+result<void> service::transmit(const msg& m, tx_token& token) {
+  return tx_submit_tracked(m, token, 0);
 }
 
-u16 service::alloc_subscriber() {
-  if (subscriber_free_head_ != INVALID_INDEX) {
-    u16 idx = subscriber_free_head_;
-    subscriber_free_head_ = subscribers_[idx].next;
-    subscribers_[idx].q = nullptr;
-    subscribers_[idx].next = INVALID_INDEX;
-    return idx;
+result<void> service::transmit_within(const msg& m, u32 lifetime_ticks) {
+  if (lifetime_ticks == 0) {
+    return fail(error_code::invalid_argument, "rtcan: zero tx lifetime");
   }
-  if (next_free_subscriber_ >= cfg_.max_subscribers) return INVALID_INDEX;
-  return next_free_subscriber_++;
+  return tx_submit(m, nullptr, lifetime_ticks);
 }
 
-void service::free_subscriber(u16 idx) {
-  subscribers_[idx].q = nullptr;
-  subscribers_[idx].next = subscriber_free_head_;
-  subscriber_free_head_ = idx;
+result<void> service::transmit_within(const msg& m, u32 lifetime_ticks,
+                                      tx_token& token) {
+  if (lifetime_ticks == 0) {
+    return fail(error_code::invalid_argument, "rtcan: zero tx lifetime");
+  }
+  return tx_submit_tracked(m, token, lifetime_ticks);
 }
 
-service::hashmap_slot* service::find_or_create_slot(u32 can_id) {
-  const u32 index = hash(can_id) % cfg_.hashmap_size;
-  hashmap_slot* slot = &map_[index];
-
-  if (!slot->occupied) {
-    slot->can_id = can_id;
-    slot->occupied = true;
-    return slot;
+result<void> service::tx_submit_tracked(const msg& m, tx_token& token,
+                                        u32 lifetime_ticks) {
+  if (token.outcome() == tx_outcome::pending) {
+    return fail(error_code::invalid_argument, "rtcan: tx token in use");
   }
 
-  hashmap_slot* cur = slot;
-  while (true) {
-    if (cur->can_id == can_id) return cur;
-    if (cur->chain_next == INVALID_INDEX) break;
-    cur = &map_[cur->chain_next];
-  }
+  // the frame can complete before tx_submit() returns, so arm it first.
+  token.timestamp_ = 0;
+  token.outcome_.store(tx_outcome::pending, std::memory_order_release);
+  auto res = tx_submit(m, &token, lifetime_ticks);
+  if (!res) token.outcome_.store(tx_outcome::idle, std::memory_order_release);
+  return res;
+}
 
-  for (u16 i = 0; i < cfg_.hashmap_size; ++i) {
-    if (!map_[i].occupied) {
-      map_[i].can_id = can_id;
-      map_[i].occupied = true;
-      cur->chain_next = i;
-      return &map_[i];
+result<void> service::tx_submit(const msg& m, tx_token* token,
+                                u32 lifetime_ticks) {
+  bool sent;
+  bool queued;
+  {
+    rtos::critical_section cs;
+    if (!rate_admit(m, rtos::tick_count())) {
+      ++tx_stats_.rate_limited;
+      return fail(error_code::out_of_memory, "rtcan: tx rate limit");
     }
+    tx_entry e = tx_entry_for(m);
+    e.token = token;
+    if (lifetime_ticks != 0) {
+      e.deadline = rtos::tick_count() + lifetime_ticks;
+      e.expires = true;
+    }
+    sent = tx_direct(e);
+    // a queue full of stale frames shouldn't turn fresh ones away.
+    queued = sent || tx_enqueue(e) ||
+             (tx_purge_expired(rtos::tick_count()) && tx_enqueue(e));
+    if (!queued) rate_refund(m);
+  }
+  if (!queued) {
+    err_ |= rtcan_error::memory_full;
+    return fail(error_code::out_of_memory, "rtcan: tx queue full");
   }
+  if (!sent && tx_task_) tx_task_->notify_give();
+  return ok();
+}
 
-  return nullptr;
+result<void> service::transmit_from_isr(const msg& m) {
+  return tx_submit_isr(m, nullptr);
 }
 
-result<void> service::subscribe(u32 can_id, rtos::queue<const msg*>& q) {
-  hashmap_slot* slot = find_or_create_slot(can_id);
-  if (!slot) {
+result<void> service::tx_submit_isr(const msg& m, service* origin) {
+  bool sent;
+  bool queued;
+  {
+    rtos::isr_critical_section cs;
+    if (!rate_admit(m, rtos::tick_count_from_isr())) {
+      ++tx_stats_.rate_limited;
+      return fail(error_code::out_of_memory, "rtcan: tx rate limit");
+    }
+    tx_entry e = tx_entry_for(m);
+    e.origin = origin;
+    sent = tx_direct(e);
+    queued = sent || tx_enqueue(e);
+    if (!queued) rate_refund(m);
+  }
+  if (!queued) {
     err_ |= rtcan_error::memory_full;
-    return fail(error_code::out_of_memory, "rtcan: subscriber hashmap full");
+    return fail(error_code::out_of_memory, "rtcan: tx queue full");
   }
+  if (!sent && tx_task_) tx_task_->notify_give_from_isr();
+  return ok();
+}
 
-  u16 si = alloc_subscriber();
-  if (si == INVALID_INDEX) {
-    err_ |= rtcan_error::memory_full;
-    return fail(error_code::out_of_memory, "rtcan: subscriber pool full");
+result<u16> service::transmit_batch(std::span<const msg> frames,
+                                    batch_mode mode) {
+  if (frames.size() > 0xFFFF) {
+    return fail(error_code::invalid_argument, "rtcan: batch too large");
   }
 
-  subscribers_[si].q = &q;
-  subscribers_[si].next = INVALID_INDEX;
+  u16 accepted = 0;
+  bool queued = false;
+  bool limited = false;
+  {
+    rtos::critical_section cs;
+    const u32 now = rtos::tick_count();
+    // frames that go straight into a mailbox never take a queue slot, so
+    // a batch that fits the free slots is always taken whole.
+    const u16 depth = cfg_.tx_queue_depth;
+    const u16 room =
+        tx_heap_size_ < depth ? static_cast<u16>(depth - tx_heap_size_) : 0;
+    if (mode == batch_mode::all_or_nothing) {
+      if (frames.size() > room) {
+        err_ |= rtcan_error::memory_full;
+        return fail(error_code::out_of_memory, "rtcan: tx queue full");
+      }
+      // the whole batch has to fit the rate limits too.
+      u16 charged = 0;
+      while (charged < frames.size() && rate_admit(frames[charged], now))
+        ++charged;
+      if (charged < frames.size()) {
+        while (charged > 0) rate_refund(frames[--charged]);
+        ++tx_stats_.rate_limited;
+        return fail(error_code::out_of_memory, "rtcan: tx rate limit");
+      }
+    }
 
-  if (slot->first_subscriber == INVALID_INDEX) {
-    slot->first_subscriber = si;
-  } else {
-    u16 cur = slot->first_subscriber;
-    while (subscribers_[cur].next != INVALID_INDEX) {
-      cur = subscribers_[cur].next;
+    for (const msg& m : frames) {
+      if (mode == batch_mode::best_effort && !rate_admit(m, now)) {
+        ++tx_stats_.rate_limited;
+        limited = true;
+        break;
+      }
+      const tx_entry e = tx_entry_for(m);
+      if (!tx_direct(e)) {
+        if (!tx_enqueue(e)) {
+          rate_refund(m);
+          break;
+        }
+        queued = true;
+      }
+      ++accepted;
     }
-    subscribers_[cur].next = si;
   }
 
+  if (queued && tx_task_) tx_task_->notify_give();
+  if (accepted < frames.size() && !limited) err_ |= rtcan_error::memory_full;
+  return ok(accepted);
+}
+
+result<void> service::transmit_latest(const msg& m) {
+  bool sent = false;
+  bool queued;
+  {
+    rtos::critical_section cs;
+    queued = tx_coalesce(m);
+    if (!queued) {
+      // only a new frame costs bus time; a coalesced payload doesn't.
+      if (!rate_admit(m, rtos::tick_count())) {
+        ++tx_stats_.rate_limited;
+        return fail(error_code::out_of_memory, "rtcan: tx rate limit");
+      }
+      const tx_entry e = tx_entry_for(m, true);
+      sent = tx_direct(e);
+      queued = sent || tx_enqueue(e);
+      if (!queued) rate_refund(m);
+    }
+  }
+  if (!queued) {
+    err_ |= rtcan_error::memory_full;
+    return fail(error_code::out_of_memory, "rtcan: tx queue full");
+  }
+  if (!sent && tx_task_) tx_task_->notify_give();
   return ok();
 }
 
-const service::hashmap_slot* service::find_slot(u32 can_id) const {
-  const u32 index = hash(can_id) % cfg_.hashmap_size;
-  const hashmap_slot* slot = &map_[index];
+service::tx_status service::tx_info() const {
+  rtos::critical_section cs;
+  tx_status st = tx_stats_;
+  st.queued = tx_heap_size_;
+  return st;
+}
 
-  if (!slot->occupied) return nullptr;
+service::traffic_status service::traffic_info() const {
+  rtos::critical_section cs;
+  return traffic_;
+}
 
-  const hashmap_slot* cur = slot;
-  while (cur) {
-    if (cur->can_id == can_id) return cur;
-    if (cur->chain_next == INVALID_INDEX) break;
-    cur = &map_[cur->chain_next];
+u16 service::id_info(std::span<id_stats> out) const {
+  rtos::critical_section cs;
+  u16 n = 0;
+  for (u16 i = 0; i < cfg_.stats_ids && n < out.size(); ++i) {
+    if (id_counters_[i].key != EMPTY_STATS_KEY) out[n++] = id_counters_[i].s;
   }
-  return nullptr;
+  return n;
 }
 
-u16 service::subscriber_count(u32 can_id) const {
-  const hashmap_slot* slot = find_slot(can_id);
-  if (!slot) return 0;
-
-  u16 count = 0;
-  u16 si = slot->first_subscriber;
-  while (si != INVALID_INDEX) {
-    ++count;
-    si = subscribers_[si].next;
+u32 service::dropped(const rtos::queue<const msg*>& q) const {
+  rtos::critical_section cs;
+  u32 n = 0;
+  for (u16 i = 0; i < fanout_size_; ++i) {
+    if (fanout_[i].q == &q) n += fanout_[i].drops;
   }
-  return count;
+  for (u16 i = 0; i < num_patterns_; ++i) {
+    if (patterns_[i].node.q == &q) n += patterns_[i].node.drops;
+  }
+  return n;
 }
 
-result<void> service::unsubscribe(u32 can_id, rtos::queue<const msg*>& q) {
-  const u32 index = hash(can_id) % cfg_.hashmap_size;
-  hashmap_slot* slot = &map_[index];
+u32 service::filtered(const rtos::queue<const msg*>& q) const {
+  rtos::scheduler_lock lock;
+  u32 n = 0;
+  for (u16 i = 0; i < fanout_size_; ++i) {
+    if (fanout_[i].q == &q) n += fanout_[i].filtered;
+  }
+  for (u16 i = 0; i < num_patterns_; ++i) {
+    if (patterns_[i].node.q == &q) n += patterns_[i].node.filtered;
+  }
+  return n;
+}
 
-  if (!slot->occupied)
-    return fail(error_code::not_found, "rtcan: no subscribers for this CAN ID");
+u32 service::dropped(u32 can_id, const rtos::queue<const msg*>& q) const {
+  rtos::scheduler_lock lock;
+  const route* r = find_route(id_key(can_id));
+  u32 n = 0;
+  for (u16 i = r ? r->first : 0; r && i < r->first + r->count; ++i) {
+    if (fanout_[i].q == &q) n += fanout_[i].drops;
+  }
+  return n;
+}
 
-  hashmap_slot* found = nullptr;
-  hashmap_slot* cur = slot;
-  while (cur) {
-    if (cur->can_id == can_id) {
-      found = cur;
-      break;
+// writers are the can isrs and tx_pump/tx_release_isr, which all run with
+// the can interrupts masked, so inserts never race each other.
+service::id_stats* service::stats_for(const msg& m) {
+  const u32 key = id_key(m);
+  u16 i = cfg_.stats_ids ? static_cast<u16>(hash(key) % cfg_.stats_ids) : 0;
+  for (u16 n = 0; n < cfg_.stats_ids; ++n) {
+    id_counter& c = id_counters_[i];
+    if (c.key == EMPTY_STATS_KEY) {
+      c.key = key;
+      c.s = {.id = m.id, .extended = m.extended};
     }
-    if (cur->chain_next == INVALID_INDEX) break;
-    cur = &map_[cur->chain_next];
+    if (c.key == key) return &c.s;
+    if (++i == cfg_.stats_ids) i = 0;
   }
+  ++traffic_.untracked;
+  return nullptr;
+}
 
-  if (!found)
-    return fail(error_code::not_found, "rtcan: no subscribers for this CAN ID");
+// same layout and keys as the stats table, but only ever filled by
+// cache_latest().
+service::latest_entry* service::latest_for(u32 key) const {
+  if (cfg_.latest_ids == 0) return nullptr;
+  u16 i = static_cast<u16>(hash(key) % cfg_.latest_ids);
+  for (u16 n = 0; n < cfg_.latest_ids; ++n) {
+    latest_entry& e = latest_[i];
+    if (e.key == key) return &e;
+    if (e.key == EMPTY_LATEST_KEY) return nullptr;
+    if (++i == cfg_.latest_ids) i = 0;
+  }
+  return nullptr;
+}
 
-  u16 prev = INVALID_INDEX;
-  u16 si = found->first_subscriber;
-  while (si != INVALID_INDEX) {
-    if (subscribers_[si].q == &q) {
-      if (prev == INVALID_INDEX) {
-        found->first_subscriber = subscribers_[si].next;
-      } else {
-        subscribers_[prev].next = subscribers_[si].next;
+result<void> service::cache_latest(u32 can_id) {
+  if (key_id(can_id) > MAX_EXT_ID)
+    return fail(error_code::invalid_argument, "rtcan: bad id");
+  const u32 key = id_key(can_id);
+  if (cfg_.latest_ids == 0)
+    return fail(error_code::out_of_memory, "rtcan: no latest-frame table");
+
+  {
+    rtos::critical_section cs;
+    u16 i = static_cast<u16>(hash(key) % cfg_.latest_ids);
+    u16 n = 0;
+    for (; n < cfg_.latest_ids; ++n) {
+      latest_entry& e = latest_[i];
+      if (e.key == key) return ok();
+      if (e.key == EMPTY_LATEST_KEY) {
+        e.key = key;
+        break;
       }
-      free_subscriber(si);
-      return ok();
+      if (++i == cfg_.latest_ids) i = 0;
+    }
+    if (n == cfg_.latest_ids) {
+      err_ |= rtcan_error::memory_full;
+      return fail(error_code::out_of_memory, "rtcan: latest-frame table full");
     }
-    prev = si;
-    si = subscribers_[si].next;
   }
 
-  return fail(error_code::not_found, "rtcan: queue not subscribed to this ID");
+  if (running_.load()) refresh_filters();
+  return ok();
+}
+
+// the isr is the only writer, so the seqlock needs no cas: bump to odd,
+// write, bump to even. readers retry if they saw an odd or changed seq.
+void service::cache_isr(const msg& m) {
+  latest_entry* e = latest_for(id_key(m));
+  if (!e) return;
+
+  const u32 seq = e->seq.load(std::memory_order_relaxed);
+  e->seq.store(seq + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  e->m = m;
+  e->tick = rtos::tick_count_from_isr();
+  e->seq.store(seq + 2, std::memory_order_release);
+}
+
+bool service::latest(u32 can_id, msg& out) const {
+  u32 age_ticks;
+  return latest(can_id, out, age_ticks);
+}
+
+bool service::latest(u32 can_id, msg& out, u32& age_ticks) const {
+  const latest_entry* e = latest_for(id_key(can_id));
+  if (!e) return false;
+
+  u32 tick;
+  u32 before;
+  do {
+    before = e->seq.load(std::memory_order_acquire);
+    out = e->m;
+    tick = e->tick;
+    std::atomic_thread_fence(std::memory_order_acquire);
+  } while ((before & 1) != 0 ||
+           before != e->seq.load(std::memory_order_relaxed));
+
+  if (before == 0) return false;
+  age_ticks = rtos::tick_count() - tick;
+  return true;
+}
+
+result<void> service::limit_rate(u32 can_id, u32 bits_per_sec,
+                                 u32 burst_bits) {
+  return add_rate_limit(can_id, can_id, bits_per_sec, burst_bits);
+}
+
+result<void> service::limit_rate_range(u32 lo, u32 hi, u32 bits_per_sec,
+                                       u32 burst_bits) {
+  // both ends name the same frame format, so the range never spans both
+  const u32 klo = id_key(lo);
+  const u32 khi = id_key(hi);
+  if (klo > khi || ((klo ^ khi) & EXTENDED_FLAG) != 0)
+    return fail(error_code::invalid_argument, "rtcan: bad id range");
+  return add_rate_limit(lo, hi, bits_per_sec, burst_bits);
+}
+
+result<void> service::unlimit_rate(u32 can_id) {
+  return remove_rate_limit(can_id, can_id);
+}
+
+result<void> service::unlimit_rate_range(u32 lo, u32 hi) {
+  return remove_rate_limit(lo, hi);
 }
 
-result<void> service::subscribe_all(rtos::queue<const msg*>& q) {
-  if (num_wildcard_subs_ >= MAX_WILDCARD_SUBS) {
-    return fail(error_code::out_of_memory,
-                "rtcan: wildcard subscriber list full");
+result<void> service::add_rate_limit(u32 lo, u32 hi, u32 bits_per_sec,
+                                     u32 burst_bits) {
+  if (key_id(lo) > MAX_EXT_ID || key_id(hi) > MAX_EXT_ID ||
+      bits_per_sec == 0 || burst_bits < MAX_FRAME_BITS) {
+    return fail(error_code::invalid_argument, "rtcan: bad rate limit");
+  }
+  lo = id_key(lo);
+  hi = id_key(hi);
+
+  rtos::critical_section cs;
+  rate_limit* slot = nullptr;
+  for (u16 i = 0; i < num_rate_limits_; ++i) {
+    if (rate_limits_[i].lo == lo && rate_limits_[i].hi == hi)
+      slot = &rate_limits_[i];
   }
-  for (u8 i = 0; i < num_wildcard_subs_; ++i) {
-    if (wildcard_subs_[i] == &q) {
-      return fail(error_code::invalid_argument,
-                  "rtcan: queue already subscribed as wildcard");
+  if (!slot) {
+    if (num_rate_limits_ >= cfg_.max_rate_limits) {
+      return fail(error_code::out_of_memory, "rtcan: rate limits full");
     }
+    slot = &rate_limits_[num_rate_limits_++];
   }
-  wildcard_subs_[num_wildcard_subs_++] = &q;
+
+  // a new or changed limit starts with a full bucket.
+  *slot = {.lo = lo,
+           .hi = hi,
+           .bits_per_sec = bits_per_sec,
+           .burst_bits = burst_bits,
+           .level = static_cast<u64>(burst_bits) * configTICK_RATE_HZ,
+           .last_tick = rtos::tick_count()};
   return ok();
 }
 
-result<void> service::unsubscribe_all(rtos::queue<const msg*>& q) {
-  for (u8 i = 0; i < num_wildcard_subs_; ++i) {
-    if (wildcard_subs_[i] == &q) {
-      wildcard_subs_[i] = wildcard_subs_[num_wildcard_subs_ - 1];
-      wildcard_subs_[num_wildcard_subs_ - 1] = nullptr;
-      --num_wildcard_subs_;
-      return ok();
-    }
+result<void> service::remove_rate_limit(u32 lo, u32 hi) {
+  lo = id_key(lo);
+  hi = id_key(hi);
+
+  rtos::critical_section cs;
+  for (u16 i = 0; i < num_rate_limits_; ++i) {
+    if (rate_limits_[i].lo != lo || rate_limits_[i].hi != hi) continue;
+    rate_limits_[i] = rate_limits_[--num_rate_limits_];
+    return ok();
   }
-  return fail(error_code::not_found, "rtcan: queue not subscribed as wildcard");
+  return fail(error_code::not_found, "rtcan: no such rate limit");
 }
 
-void service::msg_consumed(const msg* m) {
-  auto* im = reinterpret_cast<internal_msg*>(reinterpret_cast<uintptr_t>(m) -
-                                             offsetof(internal_msg, payload));
+void service::rate_refill(rate_limit& r, u32 now) {
+  const u64 cap = static_cast<u64>(r.burst_bits) * configTICK_RATE_HZ;
+  const u64 level =
+      r.level + static_cast<u64>(now - r.last_tick) * r.bits_per_sec;
+  r.level = level < cap ? level : cap;
+  r.last_tick = now;
+}
 
-  u16 prev = im->refcount.fetch_sub(1, std::memory_order_acq_rel);
-  if (prev == 1) {
-    u16 slot_index = static_cast<u16>(im - rx_pool_);
-    rx_free_list_->send(slot_index, 0);
+// charges m to every limit covering its id, or to none of them if any is
+// out of budget. callers hold a critical section.
+bool service::rate_admit(const msg& m, u32 now) {
+  if (num_rate_limits_ == 0) return true;
+
+  const u32 key = id_key(m);
+  const u32 bits = frame_bits(m);
+  const u64 cost = static_cast<u64>(bits) * configTICK_RATE_HZ;
+  bool fits = true;
+  for (u16 i = 0; i < num_rate_limits_; ++i) {
+    rate_limit& r = rate_limits_[i];
+    if (key < r.lo || key > r.hi) continue;
+    rate_refill(r, now);
+    if (r.level < cost) {
+      ++r.rejected;
+      fits = false;
+    }
   }
+  if (!fits) return false;
+
+  for (u16 i = 0; i < num_rate_limits_; ++i) {
+    rate_limit& r = rate_limits_[i];
+    if (key < r.lo || key > r.hi) continue;
+    r.level -= cost;
+    r.bits += bits;
+    ++r.frames;
+  }
+  return true;
 }
 
-void service::handle_tx_complete_isr() { tx_mailbox_sem_->give_from_isr(); }
+// gives back what rate_admit() charged for a frame that wasn't queued.
+void service::rate_refund(const msg& m) {
+  if (num_rate_limits_ == 0) return;
+
+  const u32 key = id_key(m);
+  const u32 bits = frame_bits(m);
+  const u64 cost = static_cast<u64>(bits) * configTICK_RATE_HZ;
+  for (u16 i = 0; i < num_rate_limits_; ++i) {
+    rate_limit& r = rate_limits_[i];
+    if (key < r.lo || key > r.hi) continue;
+    r.level += cost;
+    r.bits -= bits;
+    --r.frames;
+  }
+}
 
-void service::handle_rx_isr(u32 fifo) {
-  u16 slot_index;
-  if (!rx_free_list_->receive_from_isr(slot_index)) {
-    CAN_RxHeaderTypeDef hdr;
-    u8 discard[8];
-    HAL_CAN_GetRxMessage(&hcan_, fifo, &hdr, discard);
-    err_ |= rtcan_error::memory_full;
-    return;
+u16 service::rate_info(std::span<rate_status> out) const {
+  rtos::critical_section cs;
+  const u32 now = rtos::tick_count();
+  u16 n = 0;
+  for (u16 i = 0; i < num_rate_limits_ && n < out.size(); ++i) {
+    rate_limit r = rate_limits_[i];
+    rate_refill(r, now);
+    out[n++] = {.lo = r.lo,
+                .hi = r.hi,
+                .bits_per_sec = r.bits_per_sec,
+                .burst_bits = r.burst_bits,
+                .available_bits =
+                    static_cast<u32>(r.level / configTICK_RATE_HZ),
+                .frames = r.frames,
+                .bits = r.bits,
+                .rejected = r.rejected};
   }
+  return n;
+}
 
-  internal_msg& im = rx_pool_[slot_index];
+u32 service::budgeted_bps() const {
+  rtos::critical_section cs;
+  u32 total = 0;
+  for (u16 i = 0; i < num_rate_limits_; ++i) {
+    total += rate_limits_[i].bits_per_sec;
+  }
+  return total;
+}
 
-  CAN_RxHeaderTypeDef hdr;
-  if (HAL_CAN_GetRxMessage(&hcan_, fifo, &hdr, im.payload.data) != HAL_OK) {
-    rx_free_list_->send_from_isr(slot_index);
-    err_ |= rtcan_error::hal;
-    return;
+bool service::tx_before(const tx_entry& a, const tx_entry& b) {
+  if (a.key != b.key) return a.key < b.key;
+  return static_cast<i32>(a.seq - b.seq) < 0;
+}
+
+bool service::tx_push(const tx_entry& e, u16 limit) {
+  if (tx_heap_size_ >= limit) return false;
+
+  u16 i = tx_heap_size_++;
+  while (i > 0) {
+    const u16 parent = (i - 1) / 2;
+    if (!tx_before(e, tx_heap_[parent])) break;
+    tx_heap_[i] = tx_heap_[parent];
+    i = parent;
   }
+  tx_heap_[i] = e;
+  return true;
+}
 
-  const u8 dlc = static_cast<u8>(hdr.DLC);
-  for (u8 i = dlc; i < 8; ++i) im.payload.data[i] = 0;
+void service::tx_pop(tx_entry& e) {
+  e = tx_heap_[0];
+  const tx_entry last = tx_heap_[--tx_heap_size_];
 
-  if (hdr.IDE == CAN_ID_EXT) {
-    im.payload.id = hdr.ExtId;
-    im.payload.extended = true;
-  } else {
-    im.payload.id = hdr.StdId;
-    im.payload.extended = false;
+  u16 i = 0;
+  while (true) {
+    u16 child = 2 * i + 1;
+    if (child >= tx_heap_size_) break;
+    if (child + 1 < tx_heap_size_ &&
+        tx_before(tx_heap_[child + 1], tx_heap_[child])) {
+      ++child;
+    }
+    if (!tx_before(tx_heap_[child], last)) break;
+    tx_heap_[i] = tx_heap_[child];
+    i = child;
   }
-  im.payload.dlc = dlc;
-  im.payload.rtr = (hdr.RTR == CAN_RTR_REMOTE);
-  im.refcount.store(0, std::memory_order_relaxed);
+  tx_heap_[i] = last;
+}
 
-  rx_notify_queue_->send_from_isr(slot_index);
+service::tx_entry service::tx_entry_for(const msg& m, bool latest) {
+  return {.m = m,
+          .key = arbitration_key(m),
+          .seq = tx_seq_++,
+          .enqueued = cycle_count(),
+          .latest = latest};
 }
 
-void service::handle_error_isr() {
-  tx_mailbox_sem_->give_from_isr();
-  HAL_CAN_ResetError(&hcan_);
-  err_ |= rtcan_error::hal;
+bool service::tx_enqueue(const tx_entry& e) {
+  return tx_push(e, cfg_.tx_queue_depth);
 }
 
-void service::tx_thread_entry(void* arg) {
-  auto* self = static_cast<service*>(arg);
+bool service::tx_expired(const tx_entry& e, u32 now) {
+  return e.expires && static_cast<i32>(now - e.deadline) >= 0;
+}
 
-  while (self->running_.load()) {
-    msg m;
-    if (!self->tx_queue_->receive(m, pdMS_TO_TICKS(100))) {
-      continue;
-    }
+void service::tx_drop_expired(const tx_entry& e) {
+  ++tx_stats_.expired;
+  if (e.token) e.token->resolve(tx_outcome::dropped, 0);
+}
 
-    if (!self->tx_mailbox_sem_->take(pdMS_TO_TICKS(500))) {
-      self->err_ |= rtcan_error::tx_timeout;
-      continue;
-    }
+// drops every expired frame from the queue and rebuilds the heap in place.
+// returns true if anything was dropped.
+bool service::tx_purge_expired(u32 now) {
+  const u16 n = tx_heap_size_;
+  u16 kept = 0;
+  for (u16 i = 0; i < n; ++i) {
+    if (tx_expired(tx_heap_[i], now))
+      tx_drop_expired(tx_heap_[i]);
+    else
+      tx_heap_[kept++] = tx_heap_[i];
+  }
+  if (kept == n) return false;
 
-    CAN_TxHeaderTypeDef hdr{};
-    if (m.extended) {
-      hdr.IDE = CAN_ID_EXT;
-      hdr.ExtId = m.id;
-    } else {
-      hdr.IDE = CAN_ID_STD;
-      hdr.StdId = m.id;
+  tx_heap_size_ = 0;
+  for (u16 i = 0; i < kept; ++i) {
+    const tx_entry e = tx_heap_[i];
+    tx_push(e, kept);
+  }
+  return true;
+}
+
+bool service::tx_coalesce(const msg& m) {
+  const u32 key = arbitration_key(m);
+
+  for (u16 i = 0; i < tx_heap_size_; ++i) {
+    tx_entry& e = tx_heap_[i];
+    if (e.latest && e.key == key) {
+      e.m = m;
+      ++tx_stats_.coalesced;
+      return true;
     }
-    hdr.RTR = m.rtr ? CAN_RTR_REMOTE : CAN_RTR_DATA;
-    hdr.DLC = m.dlc;
+  }
 
-    u32 mailbox;
-    if (HAL_CAN_AddTxMessage(&self->hcan_, &hdr, m.data, &mailbox) != HAL_OK) {
-      self->err_ |= rtcan_error::hal;
-      self->tx_mailbox_sem_->give();
+  // a pending mailbox can't be rewritten, so abort it and let the release
+  // isr requeue the new payload (or send it next if the abort lost).
+  for (u8 i = 0; i < TX_MAILBOXES; ++i) {
+    tx_mailbox& box = tx_mailboxes_[i];
+    if (!box.busy || !box.e.latest || box.e.key != key) continue;
+
+    box.e.m = m;
+    box.updated = true;
+    if (!box.aborting && HAL_CAN_AbortTxRequest(&hcan_, 1u << i) == HAL_OK) {
+      box.aborting = true;
     }
+    return true;
   }
+
+  return false;
 }
 
-void service::rx_thread_entry(void* arg) {
-  auto* self = static_cast<service*>(arg);
+bool service::tx_ready(u32 key) const {
+  const u32 tsr = hcan_.Instance->TSR;
+  if ((tsr & CAN_TSR_TME) == 0) return false;
 
-  while (self->running_.load()) {
-    u16 slot_index;
-    if (!self->rx_notify_queue_->receive(slot_index, pdMS_TO_TICKS(100))) {
-      continue;
-    }
+  const u8 next = static_cast<u8>((tsr & CAN_TSR_CODE) >> CAN_TSR_CODE_Pos);
+  if (tx_mailboxes_[next].busy) return false;
 
-    internal_msg& im = self->rx_pool_[slot_index];
+  // bxcan breaks id ties by lowest mailbox number, so an older frame with
+  // the same id in a higher mailbox must leave first.
+  for (u8 i = next + 1; i < TX_MAILBOXES; ++i) {
+    if (tx_mailboxes_[i].busy && tx_mailboxes_[i].e.key == key) return false;
+  }
+  return true;
+}
 
-    hashmap_slot* found = nullptr;
-    {
-      const u32 index = self->hash(im.payload.id) % self->cfg_.hashmap_size;
-      hashmap_slot* slot = &self->map_[index];
-
-      if (slot->occupied) {
-        hashmap_slot* cur = slot;
-        while (cur) {
-          if (cur->can_id == im.payload.id) {
-            found = cur;
-            break;
-          }
-          if (cur->chain_next == INVALID_INDEX) break;
-          cur = &self->map_[cur->chain_next];
-        }
-      }
+bool service::tx_load(const tx_entry& e) {
+  u8 mailbox;
+  if (!add_to_mailbox(e.m, mailbox)) {
+    err_ |= rtcan_error::hal;
+    return false;
+  }
+
+  tx_mailboxes_[mailbox] = {
+      .e = e, .busy = true, .aborting = false, .updated = false};
+
+  tx_class_stats& cls = tx_stats_.classes[priority_class(e.key)];
+  const u32 waited = cycle_count() - e.enqueued;
+  ++cls.frames;
+  if (waited > cls.worst_cycles) cls.worst_cycles = waited;
+  traffic_.tx_wait.add(waited);
+  return true;
+}
+
+// uncontended path: with nothing queued, a frame that may take the free
+// mailbox goes straight in from the caller, without waking the tx thread.
+// anything already queued was there first (or is waiting on a same-id
+// frame), so the frame queues behind it instead.
+bool service::tx_direct(const tx_entry& e) {
+  if (tx_heap_size_ != 0 || !running_.load()) return false;
+  if (!tx_ready(e.key)) return false;
+  if (!tx_load(e)) return false;
+  ++tx_stats_.direct;
+  return true;
+}
+
+void service::tx_pump() {
+  const u32 now = rtos::tick_count();
+  while (tx_heap_size_ > 0) {
+    if (tx_expired(tx_heap_[0], now)) {
+      tx_entry e;
+      tx_pop(e);
+      tx_drop_expired(e);
+      continue;
     }
+    if (!tx_ready(tx_heap_[0].key)) break;
 
-    u16 id_count = 0;
-    if (found && found->first_subscriber != INVALID_INDEX) {
-      u16 si = found->first_subscriber;
-      while (si != INVALID_INDEX) {
-        ++id_count;
-        si = self->subscribers_[si].next;
-      }
+    tx_entry e;
+    tx_pop(e);
+    if (!tx_load(e)) {
+      if (e.token) e.token->resolve(tx_outcome::dropped, 0);
+      break;
     }
+  }
+
+  if (tx_heap_size_ == 0) {
+    tx_stalled_ = false;
+    return;
+  }
+
+  if (!tx_stalled_) {
+    tx_stalled_ = true;
+    tx_stall_since_ = now;
+  }
+
+  u8 victim = TX_MAILBOXES;
+  for (u8 i = 0; i < TX_MAILBOXES; ++i) {
+    const tx_mailbox& box = tx_mailboxes_[i];
+    if (!box.busy) return;
+    if (box.aborting) return;
+    if (victim == TX_MAILBOXES || tx_before(tx_mailboxes_[victim].e, box.e))
+      victim = i;
+  }
 
-    u16 wc_count = self->num_wildcard_subs_;
-    u16 total = id_count + wc_count;
+  if (tx_before(tx_heap_[0], tx_mailboxes_[victim].e) &&
+      tx_heap_[0].key != tx_mailboxes_[victim].e.key) {
+    if (HAL_CAN_AbortTxRequest(&hcan_, 1u << victim) == HAL_OK) {
+      tx_mailboxes_[victim].aborting = true;
+      ++tx_stats_.preemptions;
+    }
+  }
+}
 
-    if (total == 0) {
-      self->rx_free_list_->send(slot_index, 0);
+// aborts mailboxes holding expired frames; the release isr then drops
+// them instead of requeueing. returns the ticks until the next pending
+// mailbox deadline, capped at limit.
+u32 service::tx_expire_mailboxes(u32 now, u32 limit) {
+  u32 next = limit;
+  for (u8 i = 0; i < TX_MAILBOXES; ++i) {
+    tx_mailbox& box = tx_mailboxes_[i];
+    if (!box.busy || !box.e.expires || box.aborting) continue;
+
+    const i32 left = static_cast<i32>(box.e.deadline - now);
+    if (left > 0) {
+      if (static_cast<u32>(left) < next) next = static_cast<u32>(left);
       continue;
     }
+    if (HAL_CAN_AbortTxRequest(&hcan_, 1u << i) == HAL_OK) box.aborting = true;
+  }
+  return next;
+}
 
-    im.refcount.store(total, std::memory_order_relaxed);
-    const msg* payload_ptr = &im.payload;
+void service::tx_release_isr(u32 mailbox, bool aborted) {
+  if (mailbox >= TX_MAILBOXES) return;
+
+  const u32 stamp = cycle_count();
+  bool pending;
+  tx_token* done = nullptr;
+  tx_outcome outcome = tx_outcome::sent;
+  {
+    rtos::isr_critical_section cs;
+    tx_mailbox& box = tx_mailboxes_[mailbox];
+    if (!box.busy) return;
+    box.busy = false;
+    box.aborting = false;
+    tx_stalled_ = false;
+
+    if (!aborted) {
+      if (id_stats* s = stats_for(box.e.m)) ++s->tx;
+      if (box.e.origin)
+        box.e.origin->forward_stats_.latency.add(stamp - box.e.m.timestamp);
+      done = box.e.token;
+      outcome = tx_outcome::sent;
+      box.e.token = nullptr;
+    }
 
-    if (found) {
-      u16 si = found->first_subscriber;
-      while (si != INVALID_INDEX) {
-        if (!self->subscribers_[si].q->send(payload_ptr, 0)) {
-          u16 prev = im.refcount.fetch_sub(1, std::memory_order_acq_rel);
-          if (prev == 1) {
-            self->rx_free_list_->send(slot_index, 0);
-          }
-        }
-        si = self->subscribers_[si].next;
-      }
+    if (box.updated) {
+      if (aborted)
+        ++tx_stats_.coalesced;
+      else
+        box.e.enqueued = cycle_count();
     }
 
-    for (u8 i = 0; i < wc_count; ++i) {
-      if (!self->wildcard_subs_[i]->send(payload_ptr, 0)) {
-        u16 prev = im.refcount.fetch_sub(1, std::memory_order_acq_rel);
-        if (prev == 1) {
-          self->rx_free_list_->send(slot_index, 0);
-        }
+    if (aborted && tx_expired(box.e, rtos::tick_count_from_isr())) {
+      ++tx_stats_.expired_in_mailbox;
+      done = box.e.token;
+      outcome = tx_outcome::dropped;
+    } else if ((aborted || box.updated) &&
+               !tx_push(box.e, static_cast<u16>(cfg_.tx_queue_depth +
+                                                TX_MAILBOXES))) {
+      err_ |= rtcan_error::memory_full;
+      if (aborted) {
+        done = box.e.token;
+        outcome = tx_outcome::dropped;
       }
     }
+    box.updated = false;
+    pending = tx_heap_size_ > 0;
+  }
+
+  if (done) done->resolve_isr(outcome, stamp);
+
+  // the tx thread only has work if frames queued behind full mailboxes.
+  if (pending && tx_task_) tx_task_->notify_give_from_isr();
+}
+
+u32 service::hash(u32 key) const {
+  u32 h = key;
+  h += (h << 12);
+  h ^= (h >> 22);
+  h += (h << 4);
+  h ^= (h >> 9);
+  h += (h << 10);
+  h ^= (h >> 2);
+  h += (h << 7);
+  h ^= (h >> 12);
+  return h;
+}
+
+// standard ids index std_routes_ directly. every extended key has
+// EXTENDED_FLAG set, so it is above MAX_STD_ID and goes to the hash.
+const service::route* service::find_route(u32 key) const {
+  if (static_lookup_) {
+    const i32 r = static_lookup_(key);
+    return (r < 0) ? nullptr : &routes_[r];
+  }
+
+  if (key <= MAX_STD_ID) {
+    const u16 r = std_routes_[key];
+    return (r == INVALID_INDEX) ? nullptr : &routes_[r];
+  }
+
+  // the index is at least half empty, so the probe always terminates.
+  u32 i = hash(key) & ext_routes_mask_;
+  while (ext_routes_[i] != INVALID_INDEX) {
+    const route& r = routes_[ext_routes_[i]];
+    if (r.can_id == key) return &r;
+    i = (i + 1) & ext_routes_mask_;
+  }
+  return nullptr;
+}
+
+service::route* service::find_or_create_route(u32 key) {
+  if (const route* r = find_route(key)) return const_cast<route*>(r);
+  if (num_routes_ >= cfg_.hashmap_size) return nullptr;
+
+  const u16 idx = num_routes_++;
+  routes_[idx] = {.can_id = key, .first = fanout_size_, .count = 0};
+
+  if (key <= MAX_STD_ID) {
+    std_routes_[key] = idx;
+  } else {
+    u32 i = hash(key) & ext_routes_mask_;
+    while (ext_routes_[i] != INVALID_INDEX) i = (i + 1) & ext_routes_mask_;
+    ext_routes_[i] = idx;
+  }
+  return &routes_[idx];
+}
+
+// routes keep their subscribers packed in fanout_, so adding or removing
+// one shifts everything after it. that only happens at (un)subscribe
+// time, and the rx thread holds the same scheduler lock while it reads.
+// key is an id_key(), or WILDCARD_ID for the subscribe_all() route.
+result<void> service::add_subscriber(u32 key, const subscriber_node& node) {
+  const bool wildcard = (key == WILDCARD_ID);
+  if (static_lookup_ && !wildcard)
+    return fail(error_code::invalid_argument, "rtcan: routes are fixed");
+  if (rx_bcast_ && node.q)
+    return fail(error_code::invalid_argument,
+                "rtcan: queue subscribers need delivery_mode::queues");
+
+  {
+    rtos::scheduler_lock lock;
+    route* r = wildcard ? &wildcard_ : find_or_create_route(key);
+    if (!r) {
+      err_ |= rtcan_error::memory_full;
+      return fail(error_code::out_of_memory, "rtcan: route table full");
+    }
+    if (fanout_size_ >= cfg_.max_subscribers) {
+      err_ |= rtcan_error::memory_full;
+      return fail(error_code::out_of_memory, "rtcan: subscriber pool full");
+    }
+    if (wildcard) {
+      for (u16 i = r->first; i < r->first + r->count; ++i) {
+        if (fanout_[i].q == node.q)
+          return fail(error_code::invalid_argument,
+                      "rtcan: queue already subscribed as wildcard");
+      }
+    }
+
+    const u16 pos = r->first + r->count;
+    for (u16 i = fanout_size_; i > pos; --i) fanout_[i] = fanout_[i - 1];
+    fanout_[pos] = node;
+    ++fanout_size_;
+
+    for (u16 i = 0; i < num_routes_; ++i) {
+      if (&routes_[i] != r && routes_[i].first >= pos) ++routes_[i].first;
+    }
+    if (r != &wildcard_ && wildcard_.first >= pos) ++wildcard_.first;
+    ++r->count;
+  }
+
+  if (running_.load()) refresh_filters();
+  return ok();
+}
+
+result<void> service::remove_subscriber(u32 key,
+                                        const rtos::queue<const msg*>* q,
+                                        rx_callback fn, void* ctx) {
+  const bool wildcard = (key == WILDCARD_ID);
+  if (static_lookup_ && !wildcard)
+    return fail(error_code::invalid_argument, "rtcan: routes are fixed");
+
+  {
+    rtos::scheduler_lock lock;
+    route* r = wildcard ? &wildcard_ : const_cast<route*>(find_route(key));
+    if (!r || r->count == 0)
+      return fail(error_code::not_found,
+                  wildcard ? "rtcan: queue not subscribed as wildcard"
+                           : "rtcan: no subscribers for this CAN ID");
+
+    u16 pos = r->first;
+    const u16 end = r->first + r->count;
+    while (pos < end && (fanout_[pos].q != q || fanout_[pos].fn != fn ||
+                         fanout_[pos].ctx != ctx)) {
+      ++pos;
+    }
+    if (pos == end)
+      return fail(error_code::not_found,
+                  wildcard ? "rtcan: queue not subscribed as wildcard"
+                           : "rtcan: not subscribed to this ID");
+
+    for (u16 i = pos; i + 1 < fanout_size_; ++i) fanout_[i] = fanout_[i + 1];
+    --fanout_size_;
+    fanout_[fanout_size_] = {};
+
+    for (u16 i = 0; i < num_routes_; ++i) {
+      if (routes_[i].first > pos) --routes_[i].first;
+    }
+    if (wildcard_.first > pos) --wildcard_.first;
+    --r->count;
+  }
+
+  if (running_.load()) refresh_filters();
+  return ok();
+}
+
+result<void> service::subscribe(u32 can_id, rtos::queue<const msg*>& q,
+                                backpressure bp, const delivery_filter& df) {
+  if (key_id(can_id) > MAX_EXT_ID)
+    return fail(error_code::invalid_argument, "rtcan: bad id");
+  return add_subscriber(id_key(can_id), {.q = &q, .bp = bp, .df = df});
+}
+
+result<void> service::unsubscribe(u32 can_id, rtos::queue<const msg*>& q) {
+  return remove_subscriber(id_key(can_id), &q, nullptr, nullptr);
+}
+
+result<void> service::subscribe_range(u32 lo, u32 hi,
+                                      rtos::queue<const msg*>& q,
+                                      backpressure bp,
+                                      const delivery_filter& df) {
+  // both ends name the same frame format, as with limit_rate_range()
+  const u32 klo = id_key(lo);
+  const u32 khi = id_key(hi);
+  if (key_id(lo) > MAX_EXT_ID || key_id(hi) > MAX_EXT_ID || klo > khi ||
+      ((klo ^ khi) & EXTENDED_FLAG) != 0) {
+    return fail(error_code::invalid_argument, "rtcan: bad id range");
+  }
+  const subscriber_node node{.q = &q, .bp = bp, .df = df};
+  return add_pattern({.lo = klo, .hi = khi, .node = node});
+}
+
+result<void> service::unsubscribe_range(u32 lo, u32 hi,
+                                        rtos::queue<const msg*>& q) {
+  return remove_pattern(id_key(lo), id_key(hi), 0, &q);
+}
+
+result<void> service::subscribe_mask(u32 id, u32 mask,
+                                     rtos::queue<const msg*>& q,
+                                     backpressure bp,
+                                     const delivery_filter& df) {
+  return add_mask_pattern(id, mask, {.q = &q, .bp = bp, .df = df});
+}
+
+result<void> service::unsubscribe_mask(u32 id, u32 mask,
+                                       rtos::queue<const msg*>& q) {
+  return remove_mask_pattern(id, mask, &q, nullptr, nullptr);
+}
+
+// id picks the format as in subscribe(), and mask only spans that
+// format's id bits. a mask whose don't-care bits are one low run is just
+// a range, e.g. 0x100/0x7F0 is 0x100-0x10F, and goes in the range index.
+service::pattern service::mask_pattern(u32 id, u32 mask) {
+  const u32 flag = id_key(id) & EXTENDED_FLAG;
+  const u32 width = flag ? MAX_EXT_ID : MAX_STD_ID;
+  mask &= width;
+  const u32 lo = (key_id(id) & mask) | flag;
+  const u32 wild = ~mask & width;
+  if ((wild & (wild + 1)) == 0) return {.lo = lo, .hi = lo | wild};
+  return {.lo = lo, .hi = lo, .mask = mask | EXTENDED_FLAG};
+}
+
+result<void> service::add_mask_pattern(u32 id, u32 mask,
+                                       const subscriber_node& node) {
+  if (key_id(id) > MAX_EXT_ID)
+    return fail(error_code::invalid_argument, "rtcan: bad id");
+
+  pattern p = mask_pattern(id, mask);
+  p.node = node;
+  return add_pattern(p);
+}
+
+result<void> service::remove_mask_pattern(u32 id, u32 mask,
+                                          const rtos::queue<const msg*>* q,
+                                          rx_callback fn, void* ctx) {
+  const pattern p = mask_pattern(id, mask);
+  return remove_pattern(p.lo, p.hi, p.mask, q, fn, ctx);
+}
+
+result<void> service::add_pattern(const pattern& p) {
+  if (rx_bcast_)
+    return fail(error_code::invalid_argument,
+                "rtcan: queue subscribers need delivery_mode::queues");
+
+  {
+    rtos::scheduler_lock lock;
+    if (num_patterns_ >= cfg_.max_patterns) {
+      err_ |= rtcan_error::memory_full;
+      return fail(error_code::out_of_memory, "rtcan: pattern table full");
+    }
+    patterns_[num_patterns_++] = p;
+    rebuild_patterns();
+  }
+
+  if (running_.load()) refresh_filters();
+  return ok();
+}
+
+result<void> service::remove_pattern(u32 lo, u32 hi, u32 mask,
+                                     const rtos::queue<const msg*>* q,
+                                     rx_callback fn, void* ctx) {
+  {
+    rtos::scheduler_lock lock;
+    u16 i = 0;
+    while (i < num_patterns_ &&
+           (patterns_[i].lo != lo || patterns_[i].hi != hi ||
+            patterns_[i].mask != mask || patterns_[i].node.q != q ||
+            patterns_[i].node.fn != fn || patterns_[i].node.ctx != ctx)) {
+      ++i;
+    }
+    if (i == num_patterns_)
+      return fail(error_code::not_found, "rtcan: not subscribed to this range");
+
+    for (; i + 1 < num_patterns_; ++i) patterns_[i] = patterns_[i + 1];
+    patterns_[--num_patterns_] = {};
+    rebuild_patterns();
+  }
+
+  if (running_.load()) refresh_filters();
+  return ok();
+}
+
+// rebuilt from scratch on every change, which is quadratic in the
+// pattern count but only runs at (un)subscribe time. the ranges become
+// disjoint segments between consecutive endpoints, so a lookup is one
+// binary search; the masks are grouped by mask and sorted by key, so a
+// lookup is one binary search per distinct mask.
+void service::rebuild_patterns() {
+  u16 np = 0;
+  for (u16 i = 0; i < num_patterns_; ++i) {
+    const pattern& p = patterns_[i];
+    if (p.mask != 0) continue;
+    pattern_points_[np++] = p.lo;
+    pattern_points_[np++] = p.hi + 1;
+  }
+  std::sort(pattern_points_, pattern_points_ + np);
+  np = static_cast<u16>(std::unique(pattern_points_, pattern_points_ + np) -
+                        pattern_points_);
+
+  num_segments_ = 0;
+  u16 next_sub = 0;
+  for (u16 s = 0; s + 1 < np; ++s) {
+    const u32 lo = pattern_points_[s];
+    const u32 hi = pattern_points_[s + 1] - 1;
+    const u16 first = next_sub;
+    for (u16 i = 0; i < num_patterns_; ++i) {
+      const pattern& p = patterns_[i];
+      if (p.mask == 0 && p.lo <= lo && p.hi >= hi) {
+        segment_subs_[next_sub++] = i;
+      }
+    }
+    if (next_sub != first) {
+      const u16 count = next_sub - first;
+      segments_[num_segments_++] = {
+          .lo = lo, .hi = hi, .first = first, .count = count};
+    }
+  }
+
+  u16 nm = 0;
+  for (u16 i = 0; i < num_patterns_; ++i) {
+    if (patterns_[i].mask != 0) mask_subs_[nm++] = i;
+  }
+  std::sort(mask_subs_, mask_subs_ + nm, [this](u16 a, u16 b) {
+    const pattern& pa = patterns_[a];
+    const pattern& pb = patterns_[b];
+    return (pa.mask != pb.mask) ? pa.mask < pb.mask : pa.lo < pb.lo;
+  });
+
+  num_mask_groups_ = 0;
+  for (u16 i = 0; i < nm; ++i) {
+    const u32 mask = patterns_[mask_subs_[i]].mask;
+    mask_group* last = num_mask_groups_ ? &mask_groups_[num_mask_groups_ - 1]
+                                        : nullptr;
+    if (last && last->mask == mask) {
+      ++last->count;
+    } else {
+      mask_groups_[num_mask_groups_++] = {.mask = mask, .first = i, .count = 1};
+    }
+  }
+}
+
+// collects the range and mask subscribers for key (an id_key()) into
+// pattern_hits_. caller holds the scheduler lock.
+u16 service::match_patterns(u32 key) {
+  u16 n = 0;
+
+  if (num_segments_ > 0) {
+    const segment* begin = segments_;
+    const segment* s = std::upper_bound(
+        begin, begin + num_segments_, key,
+        [](u32 k, const segment& seg) { return k < seg.lo; });
+    if (s != begin && key <= (--s)->hi) {
+      for (u16 i = 0; i < s->count; ++i) {
+        pattern_hits_[n++] = segment_subs_[s->first + i];
+      }
+    }
+  }
+
+  for (u16 g = 0; g < num_mask_groups_; ++g) {
+    const mask_group& grp = mask_groups_[g];
+    const u32 masked = key & grp.mask;
+    const u16* first = mask_subs_ + grp.first;
+    const u16* last = first + grp.count;
+    const u16* it = std::lower_bound(first, last, masked, [this](u16 i, u32 k) {
+      return patterns_[i].lo < k;
+    });
+    for (; it != last && patterns_[*it].lo == masked; ++it) {
+      pattern_hits_[n++] = *it;
+    }
+  }
+  return n;
+}
+
+static u32 budget_cycles(u32 budget_us) {
+  return (budget_us == 0) ? 0xFFFF'FFFF
+                          : budget_us * (HAL_RCC_GetHCLKFreq() / 1'000'000);
+}
+
+result<void> service::subscribe(u32 can_id, rx_callback fn, void* ctx,
+                                u32 budget_us) {
+  if (!fn) return fail(error_code::invalid_argument, "rtcan: null callback");
+  if (key_id(can_id) > MAX_EXT_ID)
+    return fail(error_code::invalid_argument, "rtcan: bad id");
+  return add_subscriber(id_key(can_id),
+                        {.fn = fn, .ctx = ctx,
+                         .budget_cycles = budget_cycles(budget_us)});
+}
+
+result<void> service::unsubscribe(u32 can_id, rx_callback fn, void* ctx) {
+  return remove_subscriber(id_key(can_id), nullptr, fn, ctx);
+}
+
+result<void> service::subscribe_mask(u32 id, u32 mask, rx_callback fn,
+                                     void* ctx, u32 budget_us) {
+  if (!fn) return fail(error_code::invalid_argument, "rtcan: null callback");
+  const subscriber_node node{.fn = fn, .ctx = ctx,
+                             .budget_cycles = budget_cycles(budget_us)};
+  return add_mask_pattern(id, mask, node);
+}
+
+result<void> service::unsubscribe_mask(u32 id, u32 mask, rx_callback fn,
+                                       void* ctx) {
+  return remove_mask_pattern(id, mask, nullptr, fn, ctx);
+}
+
+u16 service::subscriber_count(u32 can_id) const {
+  const route* r = find_route(id_key(can_id));
+  return r ? r->count : 0;
+}
+
+u16 service::callback_info(std::span<callback_status> out) const {
+  rtos::scheduler_lock lock;
+  u16 n = 0;
+  for (u16 i = 0; i < num_routes_; ++i) {
+    const route& r = routes_[i];
+    for (u16 j = r.first; j < r.first + r.count && n < out.size(); ++j) {
+      const subscriber_node& s = fanout_[j];
+      if (!s.fn) continue;
+      out[n++] = {.can_id = r.can_id,
+                  .fn = s.fn,
+                  .ctx = s.ctx,
+                  .calls = s.calls,
+                  .budget_cycles = s.budget_cycles,
+                  .worst_cycles = s.worst_cycles,
+                  .overruns = s.overruns,
+                  .disabled = s.disabled};
+    }
+  }
+  return n;
+}
+
+// callbacks can't be preempted, so the budget is enforced after the fact:
+// every overrun is counted and flagged, and callback_strikes overruns in
+// a row disable the callback until it is subscribed again.
+void service::run_callback(subscriber_node& s, const msg& m) {
+  const u32 start = cycle_count();
+  s.fn(m, s.ctx);
+  const u32 took = cycle_count() - start;
+
+  ++s.calls;
+  if (took > s.worst_cycles) s.worst_cycles = took;
+  if (took <= s.budget_cycles) {
+    s.strikes = 0;
+    return;
+  }
+
+  ++s.overruns;
+  err_ |= rtcan_error::callback_overrun;
+  if (cfg_.callback_strikes != 0 && ++s.strikes >= cfg_.callback_strikes) {
+    s.disabled = true;
+  }
+}
+
+// applies sub's backpressure policy without blocking: drop_oldest and
+// latest_only make room by releasing queued frames (each counted as a
+// drop), and a block_for subscriber with a full queue is deferred so the
+// caller can wait for it outside the scheduler lock.
+service::offer_result service::offer(subscriber_node& sub, const msg* m) {
+  rtos::queue<const msg*>& q = *sub.q;
+  const msg* old = nullptr;
+
+  if (sub.bp.p == backpressure::policy::latest_only) {
+    while (q.receive(old, 0)) {
+      msg_consumed(old);
+      count_drop(sub);
+    }
+  } else if (sub.bp.p == backpressure::policy::drop_oldest && q.spaces() == 0 &&
+             q.receive(old, 0)) {
+    msg_consumed(old);
+    count_drop(sub);
+  }
+
+  if (q.send(m, 0)) return offer_result::sent;
+  if (sub.bp.p == backpressure::policy::block && sub.bp.ticks > 0)
+    return offer_result::deferred;
+  return offer_result::dropped;
+}
+
+void service::count_drop(subscriber_node& sub) {
+  ++sub.drops;
+  ++traffic_.queue_drops;
+}
+
+bool service::wanted(subscriber_node& sub, const msg& m) {
+  const delivery_filter& df = sub.df;
+  if (df.on_change && sub.delivered && m.dlc == sub.last_dlc &&
+      std::memcmp(m.data, sub.last_data, sizeof(m.data)) == 0) {
+    return false;
+  }
+  if (df.min_interval != 0 && sub.delivered &&
+      rtos::tick_count() - sub.last_tick < df.min_interval) {
+    return false;
+  }
+  if (df.every > 1 && ++sub.skip_count < df.every) return false;
+  sub.skip_count = 0;
+  return true;
+}
+
+void service::mark_delivered(subscriber_node& sub, const msg& m) {
+  sub.delivered = true;
+  sub.last_tick = rtos::tick_count();
+  sub.last_dlc = m.dlc;
+  std::memcpy(sub.last_data, m.data, sizeof(m.data));
+}
+
+result<void> service::subscribe_all(rtos::queue<const msg*>& q,
+                                    backpressure bp,
+                                    const delivery_filter& df) {
+  return add_subscriber(WILDCARD_ID, {.q = &q, .bp = bp, .df = df});
+}
+
+result<void> service::unsubscribe_all(rtos::queue<const msg*>& q) {
+  return remove_subscriber(WILDCARD_ID, &q, nullptr, nullptr);
+}
+
+result<void> service::subscribe_all(ring_reader& r) {
+  if (!rx_bcast_)
+    return fail(error_code::invalid_argument,
+                "rtcan: ring readers need delivery_mode::ring");
+  if (r.svc_)
+    return fail(error_code::invalid_argument, "rtcan: reader already attached");
+
+  {
+    rtos::scheduler_lock lock;
+    r.svc_ = this;
+    r.cursor_ = rx_bcast_->head();
+    r.next_ = readers_;
+    readers_ = &r;
+  }
+  if (running_.load()) refresh_filters();
+  return ok();
+}
+
+result<void> service::unsubscribe_all(ring_reader& r) {
+  if (r.svc_ != this)
+    return fail(error_code::not_found, "rtcan: reader not attached");
+
+  {
+    rtos::scheduler_lock lock;
+    ring_reader** link = &readers_;
+    while (*link != &r) link = &(*link)->next_;
+    *link = r.next_;
+    r.next_ = nullptr;
+    r.svc_ = nullptr;
+  }
+  rtos::notify_give(r.waiter_.exchange(nullptr));
+  if (running_.load()) refresh_filters();
+  return ok();
+}
+
+void service::msg_consumed(const msg* m) {
+  auto* im = reinterpret_cast<internal_msg*>(reinterpret_cast<uintptr_t>(m) -
+                                             offsetof(internal_msg, payload));
+
+  u16 prev = im->refcount.fetch_sub(1, std::memory_order_acq_rel);
+  if (prev == 1) {
+    rx_slot_free(static_cast<u16>(im - rx_pool_));
+  }
+}
+
+result<void> service::register_isr_handler(u32 can_id, isr_handler fn,
+                                           void* ctx) {
+  if (!fn) return fail(error_code::invalid_argument, "rtcan: null isr handler");
+  if (key_id(can_id) > MAX_EXT_ID)
+    return fail(error_code::invalid_argument, "rtcan: bad id");
+
+  const u32 key = id_key(can_id);
+  {
+    rtos::critical_section cs;
+    for (u8 i = 0; i < num_isr_handlers_; ++i) {
+      if (isr_handlers_[i].can_id == key) {
+        return fail(error_code::invalid_argument,
+                    "rtcan: isr handler already registered for this ID");
+      }
+    }
+    if (num_isr_handlers_ >= MAX_ISR_HANDLERS) {
+      return fail(error_code::out_of_memory, "rtcan: isr handler table full");
+    }
+    isr_handlers_[num_isr_handlers_++] = {key, fn, ctx};
+  }
+
+  if (running_.load()) refresh_filters();
+  return ok();
+}
+
+result<void> service::unregister_isr_handler(u32 can_id) {
+  const u32 key = id_key(can_id);
+  bool removed = false;
+  {
+    rtos::critical_section cs;
+    for (u8 i = 0; i < num_isr_handlers_; ++i) {
+      if (isr_handlers_[i].can_id == key) {
+        isr_handlers_[i] = isr_handlers_[--num_isr_handlers_];
+        isr_handlers_[num_isr_handlers_] = {};
+        removed = true;
+        break;
+      }
+    }
+  }
+
+  if (!removed)
+    return fail(error_code::not_found, "rtcan: no isr handler for this ID");
+  if (running_.load()) refresh_filters();
+  return ok();
+}
+
+result<void> service::set_rtr_responses(std::span<const msg> table) {
+  if (table.size() > MAX_RTR_RESPONSES) {
+    return fail(error_code::out_of_memory, "rtcan: rtr response table full");
+  }
+
+  {
+    rtos::critical_section cs;
+    for (usize i = 0; i < table.size(); ++i) {
+      rtr_responses_[i] = table[i];
+      rtr_responses_[i].rtr = false;
+    }
+    num_rtr_responses_ = static_cast<u8>(table.size());
+  }
+
+  if (running_.load()) refresh_filters();
+  return ok();
+}
+
+u16 service::next_rx_seq(const msg& m) {
+  if (!m.extended) return rx_seq_std_[m.id & MAX_STD_ID]++;
+
+  u32 i = hash(m.id) & rx_seq_ext_mask_;
+  for (u32 n = 0; n <= rx_seq_ext_mask_; ++n) {
+    if (rx_seq_ext_ids_[i] == EMPTY_EXT_ID) rx_seq_ext_ids_[i] = m.id;
+    if (rx_seq_ext_ids_[i] == m.id) return rx_seq_ext_[i]++;
+    i = (i + 1) & rx_seq_ext_mask_;
+  }
+  return rx_seq_ext_[rx_seq_ext_mask_ + 1]++;
+}
+
+bool service::dispatch_isr(const msg& m) {
+  if (m.rtr) {
+    for (u8 i = 0; i < num_rtr_responses_; ++i) {
+      const msg& r = rtr_responses_[i];
+      if (r.id == m.id && r.extended == m.extended) {
+        transmit_from_isr(r);
+        return true;
+      }
+    }
+  }
+
+  const u32 key = id_key(m);
+  for (u8 i = 0; i < num_isr_handlers_; ++i) {
+    if (isr_handlers_[i].can_id == key) {
+      isr_handlers_[i].fn(m, isr_handlers_[i].ctx);
+      return true;
+    }
+  }
+  return false;
+}
+
+bool service::add_to_mailbox(const msg& m, u8& mailbox) {
+  CAN_TxHeaderTypeDef hdr{};
+  if (m.extended) {
+    hdr.IDE = CAN_ID_EXT;
+    hdr.ExtId = m.id;
+  } else {
+    hdr.IDE = CAN_ID_STD;
+    hdr.StdId = m.id;
+  }
+  hdr.RTR = m.rtr ? CAN_RTR_REMOTE : CAN_RTR_DATA;
+  hdr.DLC = m.dlc;
+
+  u32 mailbox_bit;
+  if (HAL_CAN_AddTxMessage(&hcan_, &hdr, m.data, &mailbox_bit) != HAL_OK)
+    return false;
+
+  mailbox = (mailbox_bit == CAN_TX_MAILBOX0)   ? 0
+            : (mailbox_bit == CAN_TX_MAILBOX1) ? 1
+                                               : 2;
+  return true;
+}
+
+u16 service::rx_slot_alloc_isr() {
+  if (rx_free_stack_) return rx_free_stack_->pop();
+
+  u16 slot_index;
+  if (!rx_free_list_->receive_from_isr(slot_index)) return INVALID_INDEX;
+  return slot_index;
+}
+
+void service::rx_slot_free(u16 slot) {
+  if (rx_free_stack_) {
+    rx_free_stack_->push(slot);
+  } else {
+    rx_free_list_->send(slot, 0);
+  }
+}
+
+void service::rx_post_isr(u16 slot) {
+  if (!rx_ring_) {
+    rx_notify_queue_->send_from_isr(slot);
+    return;
+  }
+
+  bool was_empty = false;
+  if (!rx_ring_->push(slot, was_empty)) {
+    rx_free_stack_->push(slot);
+    err_ |= rtcan_error::memory_full;
+    return;
+  }
+  if (was_empty && rx_task_) rx_task_->notify_give_from_isr();
+}
+
+bool service::rx_next(u16& slot, u32 timeout_ticks) {
+  if (!rx_ring_) return rx_notify_queue_->receive(slot, timeout_ticks);
+
+  if (rx_ring_->pop(slot)) return true;
+  rtos::this_task::notify_take(true, timeout_ticks);
+  return rx_ring_->pop(slot);
+}
+
+void service::handle_tx_complete_isr(u32 mailbox) {
+  tx_release_isr(mailbox, false);
+}
+
+void service::handle_tx_abort_isr(u32 mailbox) { tx_release_isr(mailbox, true); }
+
+void service::handle_rx_isr(u32 fifo) {
+  const u32 now = cycle_count();
+
+  CAN_RxHeaderTypeDef hdr;
+  msg m{};
+  if (HAL_CAN_GetRxMessage(&hcan_, fifo, &hdr, m.data) != HAL_OK) {
+    err_ |= rtcan_error::hal;
+    return;
+  }
+
+  const u8 dlc = static_cast<u8>(hdr.DLC);
+  for (u8 i = dlc; i < 8; ++i) m.data[i] = 0;
+
+  if (hdr.IDE == CAN_ID_EXT) {
+    m.id = hdr.ExtId;
+    m.extended = true;
+  } else {
+    m.id = hdr.StdId;
+    m.extended = false;
+  }
+  m.dlc = dlc;
+  m.rtr = (hdr.RTR == CAN_RTR_REMOTE);
+  m.timestamp = now;
+  m.seq = next_rx_seq(m);
+  ++rx_accepted_;
+
+  id_stats* s = stats_for(m);
+  if (s) ++s->rx;
+  cache_isr(m);
+  if (capture_) capture_->record_isr(m, cfg_.instance == CAN2);
+  if (peer_) forward_isr(m);
+
+  if (dispatch_isr(m)) return;
+
+  if (rx_bcast_) {
+    // the rx thread only blocks once it has seen everything before this
+    // frame, so that is the only time it needs waking.
+    const u32 head = rx_bcast_->publish(m);
+    if (rx_bcast_seen_.load() == head - 1 && rx_task_)
+      rx_task_->notify_give_from_isr();
+    return;
+  }
+
+  const u16 slot_index = rx_slot_alloc_isr();
+  if (slot_index == INVALID_INDEX) {
+    ++traffic_.pool_exhausted;
+    if (s) ++s->pool_drops;
+    err_ |= rtcan_error::memory_full;
+    return;
+  }
+
+  internal_msg& im = rx_pool_[slot_index];
+  im.payload = m;
+  im.refcount.store(0, std::memory_order_relaxed);
+
+  rx_post_isr(slot_index);
+}
+
+result<void> service::forward_to(service& peer,
+                                 std::span<const forward_rule> rules,
+                                 bool forward_unmatched) {
+  if (&peer == this) {
+    return fail(error_code::invalid_argument, "rtcan: can't forward to self");
+  }
+  if (rules.size() > MAX_FORWARD_RULES) {
+    return fail(error_code::out_of_memory, "rtcan: forward table full");
+  }
+
+  {
+    rtos::critical_section cs;
+    for (usize i = 0; i < rules.size(); ++i) forward_rules_[i] = rules[i];
+    num_forward_rules_ = static_cast<u8>(rules.size());
+    forward_unmatched_ = forward_unmatched;
+    peer_ = &peer;
+  }
+
+  if (running_.load()) refresh_filters();
+  return ok();
+}
+
+result<void> service::stop_forwarding() {
+  {
+    rtos::critical_section cs;
+    peer_ = nullptr;
+    num_forward_rules_ = 0;
+  }
+
+  if (running_.load()) refresh_filters();
+  return ok();
+}
+
+service::forward_status service::forward_info() const {
+  rtos::critical_section cs;
+  return forward_stats_;
+}
+
+void service::forward_isr(const msg& m) {
+  const forward_rule* rule = nullptr;
+  for (u8 i = 0; i < num_forward_rules_; ++i) {
+    const forward_rule& r = forward_rules_[i];
+    if (m.extended == r.extended && ((m.id ^ r.id) & r.mask) == 0) {
+      rule = &r;
+      break;
+    }
+  }
+
+  if (rule ? rule->drop : !forward_unmatched_) {
+    ++forward_stats_.dropped;
+    return;
+  }
+
+  msg out = m;
+  if (rule && rule->remap_mask != 0) {
+    out.id = (m.id & ~rule->remap_mask) | (rule->remap_id & rule->remap_mask);
+    out.id &= m.extended ? MAX_EXT_ID : MAX_STD_ID;
+  }
+
+  if (peer_->tx_submit_isr(out, this))
+    ++forward_stats_.forwarded;
+  else
+    ++forward_stats_.failed;
+}
+
+void service::attach_capture(capture& cap) {
+  {
+    rtos::critical_section cs;
+    capture_ = &cap;
+  }
+
+  if (running_.load()) refresh_filters();
+}
+
+void service::detach_capture() {
+  {
+    rtos::critical_section cs;
+    capture_ = nullptr;
+  }
+
+  if (running_.load()) refresh_filters();
+}
+
+void service::handle_error_isr() {
+  const u32 e = HAL_CAN_GetError(&hcan_);
+  if (capture_) {
+    capture_->record_error_isr(e, hcan_.Instance->ESR, cycle_count(),
+                               cfg_.instance == CAN2);
+  }
+  if (e & HAL_CAN_ERROR_RX_FOV0) ++traffic_.fifo_overruns[0];
+  if (e & HAL_CAN_ERROR_RX_FOV1) ++traffic_.fifo_overruns[1];
+  HAL_CAN_ResetError(&hcan_);
+  err_ |= rtcan_error::hal;
+}
+
+void service::tx_thread_entry(void* arg) {
+  auto* self = static_cast<service*>(arg);
+
+  while (self->running_.load()) {
+    bool stalled;
+    u32 stall_since;
+    u32 wait;
+    {
+      rtos::critical_section cs;
+      self->tx_pump();
+      stalled = self->tx_stalled_;
+      stall_since = self->tx_stall_since_;
+      wait = self->tx_expire_mailboxes(rtos::tick_count(), pdMS_TO_TICKS(100));
+    }
+
+    if (stalled && rtos::tick_count() - stall_since >= pdMS_TO_TICKS(500)) {
+      self->err_ |= rtcan_error::tx_timeout;
+    }
+
+    rtos::this_task::notify_take(true, wait);
+  }
+}
+
+void service::rx_thread_entry(void* arg) {
+  auto* self = static_cast<service*>(arg);
+
+  if (self->rx_bcast_) {
+    while (self->running_.load()) {
+      self->rx_broadcast();
+      rtos::this_task::notify_take(true, pdMS_TO_TICKS(100));
+    }
+    return;
+  }
+
+  while (self->running_.load()) {
+    u16 slot_index;
+    if (!self->rx_next(slot_index, pdMS_TO_TICKS(100))) {
+      continue;
+    }
+
+    internal_msg& im = self->rx_pool_[slot_index];
+    // read before fan-out: once the last subscriber consumes it the slot
+    // can be reused by the isr.
+    const u32 stamp = im.payload.timestamp;
+
+    const msg* payload_ptr = &im.payload;
+    auto release = [&] {
+      if (im.refcount.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        self->rx_slot_free(slot_index);
+      }
+    };
+
+    // block_for subscribers whose queue was full. the wait can't happen
+    // with the scheduler suspended, so they are retried after the lock.
+    // slot is the subscriber's index in fanout_, or in patterns_ for
+    // PATTERN_ID, so a queue on several patterns is charged to the right one.
+    struct deferred_send {
+      u32 route_id = 0;
+      u16 slot = 0;
+      rtos::queue<const msg*>* q = nullptr;
+      u32 ticks = 0;
+    };
+    deferred_send deferred[MAX_DEFERRED_SENDS]{};
+    u8 num_deferred = 0;
+
+    {
+      rtos::scheduler_lock lock;
+      const route* r = self->find_route(id_key(im.payload));
+      const u16 id_count = r ? r->count : 0;
+      const u16 wc_count = self->wildcard_.count;
+      const u16 pattern_count = self->match_patterns(id_key(im.payload));
+      const u16 total = id_count + wc_count + pattern_count;
+
+      if (total == 0) {
+        ++self->rx_unrouted_;
+        self->rx_slot_free(slot_index);
+        continue;
+      }
+
+      im.refcount.store(total, std::memory_order_relaxed);
+
+      auto deliver = [&](u32 route_id, u16 slot, subscriber_node& sub) {
+        if (!wanted(sub, im.payload)) {
+          ++sub.filtered;
+          ++self->traffic_.filtered;
+          release();
+          return;
+        }
+
+        if (sub.fn) {
+          if (!sub.disabled) self->run_callback(sub, im.payload);
+          mark_delivered(sub, im.payload);
+          release();
+          return;
+        }
+
+        const offer_result res = self->offer(sub, payload_ptr);
+        if (res == offer_result::deferred &&
+            num_deferred < MAX_DEFERRED_SENDS) {
+          deferred[num_deferred++] = {route_id, slot, sub.q, sub.bp.ticks};
+          mark_delivered(sub, im.payload);
+        } else if (res != offer_result::sent) {
+          self->count_drop(sub);
+          release();
+        } else {
+          mark_delivered(sub, im.payload);
+        }
+      };
+      for (u16 i = 0; i < id_count; ++i) {
+        const u16 j = r->first + i;
+        deliver(r->can_id, j, self->fanout_[j]);
+      }
+      for (u16 i = 0; i < wc_count; ++i) {
+        const u16 j = self->wildcard_.first + i;
+        deliver(WILDCARD_ID, j, self->fanout_[j]);
+      }
+      for (u16 i = 0; i < pattern_count; ++i) {
+        const u16 j = self->pattern_hits_[i];
+        deliver(PATTERN_ID, j, self->patterns_[j].node);
+      }
+    }
+
+    for (u8 i = 0; i < num_deferred; ++i) {
+      const deferred_send& d = deferred[i];
+      if (d.q->send(payload_ptr, d.ticks)) continue;
+
+      {
+        // the subscription may have moved or gone while we waited; only
+        // charge the slot if it still holds this queue.
+        rtos::scheduler_lock lock;
+        subscriber_node* sub = nullptr;
+        if (d.route_id == PATTERN_ID) {
+          if (d.slot < self->num_patterns_)
+            sub = &self->patterns_[d.slot].node;
+        } else {
+          const route* r = (d.route_id == WILDCARD_ID)
+                               ? &self->wildcard_
+                               : self->find_route(d.route_id);
+          if (r && d.slot >= r->first && d.slot < r->first + r->count)
+            sub = &self->fanout_[d.slot];
+        }
+        if (sub && sub->q == d.q) self->count_drop(*sub);
+      }
+      release();
+    }
+
+    self->traffic_.rx_latency.add(cycle_count() - stamp);
+  }
+}
+
+// delivery_mode::ring counterpart of the fan-out: the frames stay in the
+// ring, so this thread only runs callbacks and wakes readers with a match.
+// seen is published after every frame so the isr can tell when we have
+// caught up and are about to block.
+void service::rx_broadcast() {
+  u32 seen = rx_bcast_seen_.load();
+  while (seen != rx_bcast_->head()) {
+    msg m;
+    const auto st = rx_bcast_->read(seen, m);
+    if (st == broadcast_ring<msg>::read_status::empty) break;
+
+    rtos::scheduler_lock lock;
+    if (st == broadcast_ring<msg>::read_status::overrun) {
+      const u32 oldest = rx_bcast_->oldest();
+      traffic_.ring_skipped += oldest - seen;
+      seen = oldest;
+      // frames we never saw may have matched anyone, so wake everyone.
+      for (ring_reader* rd = readers_; rd; rd = rd->next_) {
+        rtos::notify_give(rd->waiter_.exchange(nullptr));
+      }
+      rx_bcast_seen_.store(seen);
+      continue;
+    }
+
+    const route* r = find_route(id_key(m));
+    bool routed = false;
+    if (r) {
+      for (u16 i = r->first; i < r->first + r->count; ++i) {
+        subscriber_node& sub = fanout_[i];
+        if (sub.fn && !sub.disabled) run_callback(sub, m);
+        routed = true;
+      }
+    }
+    for (ring_reader* rd = readers_; rd; rd = rd->next_) {
+      if (!rd->matches(m)) continue;
+      rtos::notify_give(rd->waiter_.exchange(nullptr));
+      routed = true;
+    }
+    if (!routed) ++rx_unrouted_;
+    traffic_.rx_latency.add(cycle_count() - m.timestamp);
+
+    rx_bcast_seen_.store(++seen);
+  }
+}
+
+// id and mask go to key space, as for subscribe_mask(), so matching
+// checks the format and the reader can share a mask bank with patterns.
+ring_reader::ring_reader(u32 id, u32 mask) {
+  const u32 flag = id_key(id) & EXTENDED_FLAG;
+  mask_ = (mask & (flag ? MAX_EXT_ID : MAX_STD_ID)) | EXTENDED_FLAG;
+  id_ = id_key(id) & mask_;
+}
+
+ring_reader::~ring_reader() {
+  if (svc_) svc_->unsubscribe_all(*this);
+}
+
+bool ring_reader::try_next(msg& out) {
+  if (!svc_) return false;
+  const broadcast_ring<msg>& ring = *svc_->rx_bcast_;
+
+  while (true) {
+    switch (ring.read(cursor_, out)) {
+      case broadcast_ring<msg>::read_status::empty:
+        return false;
+      case broadcast_ring<msg>::read_status::overrun: {
+        const u32 oldest = ring.oldest();
+        ++overruns_;
+        lost_ += oldest - cursor_;
+        cursor_ = oldest;
+        break;
+      }
+      case broadcast_ring<msg>::read_status::ok:
+        ++cursor_;
+        if (matches(out)) return true;
+        break;
+    }
+  }
+}
+
+// the waiter is published before the second look, so a frame that lands
+// in between is either seen here or followed by a wake from the rx thread.
+bool ring_reader::next(msg& out, u32 timeout_ticks) {
+  const u32 start = rtos::tick_count();
+  while (svc_) {
+    if (try_next(out)) return true;
+
+    waiter_.store(rtos::this_task::handle());
+    if (try_next(out)) {
+      waiter_.store(nullptr);
+      return true;
+    }
+
+    u32 wait = portMAX_DELAY;
+    if (timeout_ticks != portMAX_DELAY) {
+      const u32 waited = rtos::tick_count() - start;
+      if (waited >= timeout_ticks) break;
+      wait = timeout_ticks - waited;
+    }
+    rtos::this_task::notify_take(true, wait);
+  }
+  waiter_.store(nullptr);
+  return false;
+}
+
+void tx_token::resolve(tx_outcome o, u32 timestamp) {
+  timestamp_ = timestamp;
+  outcome_.store(o, std::memory_order_release);
+  rtos::notify_give(waiter_.load());
+}
+
+void tx_token::resolve_isr(tx_outcome o, u32 timestamp) {
+  timestamp_ = timestamp;
+  outcome_.store(o, std::memory_order_release);
+  rtos::notify_give_from_isr(waiter_.load());
+}
+
+bool tx_token::wait(u32 timeout_ticks) {
+  const u32 start = rtos::tick_count();
+  while (outcome() == tx_outcome::pending) {
+    waiter_.store(rtos::this_task::handle());
+    if (outcome() != tx_outcome::pending) break;
+
+    u32 wait = portMAX_DELAY;
+    if (timeout_ticks != portMAX_DELAY) {
+      const u32 waited = rtos::tick_count() - start;
+      if (waited >= timeout_ticks) break;
+      wait = timeout_ticks - waited;
+    }
+    rtos::this_task::notify_take(true, wait);
   }
+  waiter_.store(nullptr);
+  return done();
 }
 
 }  // namespace jstm::rtcan
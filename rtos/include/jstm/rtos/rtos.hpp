@@ -16,10 +16,24 @@ inline void start_scheduler() { vTaskStartScheduler(); }
 
 inline u32 tick_count() { return xTaskGetTickCount(); }
 
+inline u32 tick_count_from_isr() { return xTaskGetTickCountFromISR(); }
+
 inline void delay(u32 ticks) { vTaskDelay(ticks); }
 
 inline void delay_ms(u32 ms) { vTaskDelay(pdMS_TO_TICKS(ms)); }
 
+// for waking a task known only by handle, e.g. one parked in a wait.
+inline void notify_give(TaskHandle_t t) {
+  if (t) xTaskNotifyGive(t);
+}
+
+inline void notify_give_from_isr(TaskHandle_t t) {
+  if (!t) return;
+  BaseType_t woken = pdFALSE;
+  vTaskNotifyGiveFromISR(t, &woken);
+  portYIELD_FROM_ISR(woken);
+}
+
 class task {
  public:
   using function_t = void (*)(void*);
@@ -63,6 +77,17 @@ class task {
     return uxTaskGetStackHighWaterMark(handle_);
   }
 
+  void notify_give() {
+    if (handle_) xTaskNotifyGive(handle_);
+  }
+
+  void notify_give_from_isr() {
+    if (!handle_) return;
+    BaseType_t woken = pdFALSE;
+    vTaskNotifyGiveFromISR(handle_, &woken);
+    portYIELD_FROM_ISR(woken);
+  }
+
   bool valid() const { return handle_ != nullptr; }
   TaskHandle_t handle() const { return handle_; }
 
@@ -119,6 +144,36 @@ class lock_guard {
   mutex& mtx_;
 };
 
+class critical_section {
+ public:
+  critical_section() { taskENTER_CRITICAL(); }
+  ~critical_section() { taskEXIT_CRITICAL(); }
+
+  critical_section(const critical_section&) = delete;
+  critical_section& operator=(const critical_section&) = delete;
+};
+
+class isr_critical_section {
+ public:
+  isr_critical_section() : saved_{taskENTER_CRITICAL_FROM_ISR()} {}
+  ~isr_critical_section() { taskEXIT_CRITICAL_FROM_ISR(saved_); }
+
+  isr_critical_section(const isr_critical_section&) = delete;
+  isr_critical_section& operator=(const isr_critical_section&) = delete;
+
+ private:
+  UBaseType_t saved_;
+};
+
+class scheduler_lock {
+ public:
+  scheduler_lock() { vTaskSuspendAll(); }
+  ~scheduler_lock() { xTaskResumeAll(); }
+
+  scheduler_lock(const scheduler_lock&) = delete;
+  scheduler_lock& operator=(const scheduler_lock&) = delete;
+};
+
 class binary_semaphore {
  public:
   binary_semaphore() : handle_{xSemaphoreCreateBinary()} {}
@@ -342,6 +397,10 @@ inline void delay_until(u32& previous_wake, u32 increment) {
 
 inline TaskHandle_t handle() { return xTaskGetCurrentTaskHandle(); }
 
+inline u32 notify_take(bool clear = true, u32 timeout_ticks = portMAX_DELAY) {
+  return ulTaskNotifyTake(clear ? pdTRUE : pdFALSE, timeout_ticks);
+}
+
 inline void suspend() { vTaskSuspend(nullptr); }
 
 }  // namespace this_task
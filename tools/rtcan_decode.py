@@ -0,0 +1,180 @@
+#!/usr/bin/env python3
+"""turn an rtcan::capture dump into a candump log or a vector asc file.
+
+    rtcan_decode.py capture.bin > capture.log
+    rtcan_decode.py --format asc capture.bin > capture.asc
+
+the dump is what capture::dump() writes: a 32-byte header, then 20-byte
+records oldest first. timestamps are dwt cycles, so they wrap every few
+seconds; the low 16 bits of the rtos tick saved with each record say how
+many wraps lie between two records, which holds for gaps shorter than
+65536 ticks. frames from CAN1 go out on can0 (asc channel 1) and frames
+from CAN2 on can1 (channel 2); --channel moves both.
+"""
+
+import argparse
+import struct
+import sys
+import time
+
+HEADER = struct.Struct("<IHHIIII8x")
+RECORD = struct.Struct("<IIHBB8s")
+MAGIC = 0x50414352
+NO_TRIGGER = 0xFFFFFFFF
+
+EXTENDED, RTR, ERROR, TRIGGER, CAN2 = 0x01, 0x02, 0x04, 0x08, 0x10
+
+# HAL_CAN_ERROR_* bits, as saved in the id of an error record
+HAL_EWG, HAL_EPV, HAL_BOF = 0x1, 0x2, 0x4
+HAL_STF, HAL_FOR, HAL_ACK, HAL_BR, HAL_BD, HAL_CRC = (
+    0x8, 0x10, 0x20, 0x40, 0x80, 0x100)
+HAL_RX_FOV = 0x200 | 0x400
+HAL_TX_ALST = 0x800 | 0x2000 | 0x8000
+
+# linux/can/error.h
+CAN_ERR_FLAG = 0x20000000
+ERR_LOSTARB, ERR_CRTL, ERR_PROT, ERR_ACK, ERR_BUSOFF, ERR_CNT = (
+    0x2, 0x4, 0x8, 0x20, 0x40, 0x200)
+
+
+def read_dump(path):
+    with open(path, "rb") as f:
+        blob = f.read()
+    if len(blob) < HEADER.size:
+        sys.exit(f"{path}: too short for a capture header")
+
+    magic, version, record_size, count, trigger, core_hz, tick_hz = (
+        HEADER.unpack_from(blob))
+    if magic != MAGIC or version != 1 or record_size != RECORD.size:
+        sys.exit(f"{path}: not an rtcan capture dump")
+    if len(blob) < HEADER.size + count * RECORD.size:
+        sys.exit(f"{path}: truncated, header says {count} records")
+
+    records = [RECORD.unpack_from(blob, HEADER.size + i * RECORD.size)
+               for i in range(count)]
+    return records, trigger, core_hz, tick_hz
+
+
+def unwrap(records, core_hz, tick_hz):
+    """seconds since the first record, one per record."""
+    out = []
+    total = 0
+    prev = None
+    for ts, _, tick, _, _, _ in records:
+        if prev is not None:
+            cycles = (ts - prev[0]) & 0xFFFFFFFF
+            ticks = (tick - prev[1]) & 0xFFFF
+            expected = ticks * core_hz // tick_hz
+            wraps = max(0, round((expected - cycles) / 2**32))
+            total += cycles + wraps * 2**32
+        out.append(total / core_hz)
+        prev = (ts, tick)
+    return out
+
+
+def error_frame(hal, esr):
+    """socketcan error frame id and data for one error record."""
+    cls = 0
+    data = bytearray(8)
+    tec, rec = (esr >> 16) & 0xFF, (esr >> 24) & 0xFF
+
+    if hal & HAL_BOF:
+        cls |= ERR_BUSOFF
+    if hal & (HAL_EWG | HAL_EPV | HAL_RX_FOV):
+        cls |= ERR_CRTL
+        if hal & HAL_RX_FOV:
+            data[1] |= 0x01
+        if hal & HAL_EWG:
+            data[1] |= (0x04 if rec >= 96 else 0) | (0x08 if tec >= 96 else 0)
+        if hal & HAL_EPV:
+            data[1] |= (0x10 if rec >= 128 else 0) | (
+                0x20 if tec >= 128 else 0)
+    if hal & HAL_TX_ALST:
+        cls |= ERR_LOSTARB
+    if hal & HAL_ACK:
+        cls |= ERR_ACK
+    if hal & (HAL_STF | HAL_FOR | HAL_BR | HAL_BD | HAL_CRC):
+        cls |= ERR_PROT
+        if hal & HAL_STF:
+            data[2] |= 0x04
+        if hal & HAL_FOR:
+            data[2] |= 0x02
+        if hal & HAL_BR:
+            data[2] |= 0x10
+        if hal & HAL_BD:
+            data[2] |= 0x08
+        if hal & HAL_CRC:
+            data[3] = 0x08
+
+    cls |= ERR_CNT
+    data[6], data[7] = tec, rec
+    return CAN_ERR_FLAG | cls, bytes(data)
+
+
+def candump(records, times, channel, start):
+    for (_, ident, _, dlc, flags, data), t in zip(records, times):
+        stamp = f"({start + t:.6f}) can{channel + bool(flags & CAN2)}"
+        if flags & ERROR:
+            eid, edata = error_frame(ident, int.from_bytes(data[:4], "little"))
+            print(f"{stamp} {eid:08X}#{edata.hex().upper()}")
+            continue
+        name = f"{ident:08X}" if flags & EXTENDED else f"{ident:03X}"
+        if flags & RTR:
+            print(f"{stamp} {name}#R{dlc if dlc else ''}")
+        else:
+            print(f"{stamp} {name}#{data[:min(dlc, 8)].hex().upper()}")
+
+
+def asc(records, times, channel, start):
+    t0 = time.localtime(start)
+    when = time.strftime("%a %b %d %I:%M:%S.000 ", t0)
+    when += time.strftime("%p", t0).lower() + time.strftime(" %Y", t0)
+    print(f"date {when}")
+    print("base hex  timestamps absolute")
+    print("internal events logged")
+    print(f"Begin Triggerblock {when}")
+    print("   0.000000 Start of measurement")
+    for (_, ident, _, dlc, flags, data), t in zip(records, times):
+        ch = channel + bool(flags & CAN2)
+        if flags & ERROR:
+            print(f"{t:11.6f} {ch}  ErrorFrame")
+            continue
+        name = f"{ident:X}x" if flags & EXTENDED else f"{ident:X}"
+        if flags & RTR:
+            print(f"{t:11.6f} {ch}  {name:<15} Rx   r {dlc:X}")
+        else:
+            n = min(dlc, 8)
+            body = " ".join(f"{b:02X}" for b in data[:n])
+            print(f"{t:11.6f} {ch}  {name:<15} Rx   d {n} {body}")
+    print("End TriggerBlock")
+
+
+def main():
+    p = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    p.add_argument("dump")
+    p.add_argument("--format", choices=("candump", "asc"), default="candump")
+    p.add_argument("--channel", type=int,
+                   help="channel of CAN1 records, CAN2 gets the next one "
+                        "(default 0 for candump, 1 for asc)")
+    p.add_argument("--start", type=float, default=0.0,
+                   help="unix time of the first record (default 0)")
+    args = p.parse_args()
+
+    records, trigger, core_hz, tick_hz = read_dump(args.dump)
+    times = unwrap(records, core_hz, tick_hz)
+    if args.format == "candump":
+        channel = 0 if args.channel is None else args.channel
+        candump(records, times, channel, args.start)
+    else:
+        channel = 1 if args.channel is None else args.channel
+        asc(records, times, channel, args.start)
+
+    if trigger != NO_TRIGGER:
+        print(f"{len(records)} records, trigger at {trigger} "
+              f"({times[trigger]:.6f} s)", file=sys.stderr)
+    else:
+        print(f"{len(records)} records, no trigger", file=sys.stderr)
+
+
+if __name__ == "__main__":
+    main()